@@ -0,0 +1,120 @@
+//
+// Arena of aligned buffers reused across data fields and granules
+//
+
+#include <sys/mman.h>
+#include "modisresam.h"
+
+enum {
+	ARENA_ALIGN = 64,		// alignment of each buffer, a cache line
+	ARENA_CHUNK = 4<<20,		// smallest chunk
+	ARENA_HUGEPAGE = 2<<20,		// size of a transparent huge page
+};
+
+// Each chunk starts with a ChunkHeader in its first ARENA_ALIGN bytes.
+struct ChunkHeader {
+	char	*prev;	// previous chunk, or NULL
+	size_t	size;	// bytes in the chunk
+};
+
+// Initialize the empty arena a. If hugepages is true, the chunks are
+// backed by transparent huge pages where the kernel allows it.
+void
+arena_init(Arena &a, bool hugepages)
+{
+	a.chunk = NULL;
+	a.size = a.used = 0;
+	a.total = a.peak = 0;
+	a.hugepages = hugepages;
+}
+
+// Map a new chunk of at least n bytes after the current chunk of a.
+static void
+arena_grow(Arena &a, size_t n)
+{
+	size_t align = a.hugepages ? ARENA_HUGEPAGE : 4096;
+	size_t size = (MAX(n, (size_t)ARENA_CHUNK) + align-1) / align * align;
+	char *p;
+
+	// the mapping is only aligned to a page, so map one huge page more
+	// and unmap the ends to align it to a huge page
+	p = (char *)mmap(NULL, size + (a.hugepages ? align : 0), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED)
+		eprintf("cannot map %ld bytes for the arena:", (long)size);
+	if(a.hugepages) {
+		char *q = (char *)(((uintptr_t)p + align-1) / align * align);
+		if(q > p)
+			munmap(p, q - p);
+		munmap(q + size, p + align - q);
+		p = q;
+		madvise(p, size, MADV_HUGEPAGE);	// ignored if unsupported
+	}
+
+	ChunkHeader *h = (ChunkHeader *)p;
+	h->prev = a.chunk;
+	h->size = size;
+	a.chunk = p;
+	a.size = size;
+	a.used = ARENA_ALIGN;
+}
+
+// Returns a buffer of n bytes from arena a, aligned to ARENA_ALIGN bytes.
+// The buffer stays valid until the arena is reset. The memory of the
+// arena is zeroed when first mapped, but not when it is reused.
+void *
+arena_alloc(Arena &a, size_t n)
+{
+	void *p;
+
+	n = (n + ARENA_ALIGN-1) / ARENA_ALIGN * ARENA_ALIGN;
+	if(a.chunk == NULL || a.used + n > a.size)
+		arena_grow(a, MAX(n, a.peak) + ARENA_ALIGN);
+	p = a.chunk + a.used;
+	a.used += n;
+	a.total += n;
+	a.peak = MAX(a.peak, a.total);
+	return p;
+}
+
+// Point m to a new rows by cols matrix of type allocated from arena a,
+// or allocated by OpenCV if a is NULL. A matrix from an arena does not
+// own its buffer, so it must not be used after the arena is reset.
+void
+arena_mat(Arena *a, Mat &m, int rows, int cols, int type)
+{
+	if(a == NULL) {
+		m = Mat(rows, cols, type);
+		return;
+	}
+	m = Mat(rows, cols, type, arena_alloc(*a, (size_t)rows*cols*CV_ELEM_SIZE(type)));
+}
+
+// Make all the memory of arena a available again. If the buffers took
+// more than one chunk, the chunks are replaced by a single one as large
+// as the most memory the arena has handed out at once, so that the same
+// buffers fit in one chunk the next time.
+void
+arena_reset(Arena &a)
+{
+	if(a.chunk != NULL && ((ChunkHeader *)a.chunk)->prev != NULL) {
+		arena_free(a);
+		arena_grow(a, a.peak + ARENA_ALIGN);
+	}
+	a.used = ARENA_ALIGN;
+	a.total = 0;
+}
+
+// Unmap all the chunks of arena a.
+void
+arena_free(Arena &a)
+{
+	while(a.chunk != NULL) {
+		ChunkHeader *h = (ChunkHeader *)a.chunk;
+		char *prev = h->prev;
+		munmap(a.chunk, h->size);
+		a.chunk = prev;
+	}
+	a.size = a.used = 0;
+	a.total = 0;
+}
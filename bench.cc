@@ -0,0 +1,442 @@
+//
+// Benchmark of the resampling and conversion kernels
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include "modisresam.h"
+
+enum {
+	WIDTH = 1354,
+	HEIGHT = 2030,
+	EMISSIVE = 32,		// index of band 31 in lambda
+	MAXRESULT = 256,
+};
+
+// Synthetic granule and the buffers the kernels work on. Bands are
+// interleaved by line in the float images, as in resample_bands.
+struct Bench {
+	int	nband;
+	Mat	lat;		// latitude
+	ResampleContext	r;	// resampling context of lat
+	Mat	sind;		// image of sorting indices
+	Mat	ref, emi;	// scaled integers of reflective and emissive bands
+	Mat	out;		// scaled integers (scratch)
+	Mat	mask;		// pixels with negative radiance
+	float	**img;		// physical values, HEIGHT x WIDTH*nband
+	Mat	simg, dst, uimg;	// sorted, resampled and unsorted images
+	BandConv	conv[40];
+};
+
+// A result of a kernel run with a number of threads.
+struct Result {
+	char	key[64];	// kernel/threads
+	double	mpix;		// throughput in MPix/s
+};
+
+static const char *progname;
+
+// Make a latitude image that looks like a MODIS granule: latitude
+// increases along the track, and towards the edges of the swath each
+// scan spreads over its neighbours like the bowtie effect.
+static void
+makelat(Mat &lat)
+{
+	lat.create(HEIGHT, WIDTH, CV_32FC1);
+	for(int y = 0; y < HEIGHT; y++) {
+		float *lp = lat.ptr<float>(y);
+		for(int x = 0; x < WIDTH; x++) {
+			float edge = fabs(x - WIDTH/2) / (WIDTH/2);
+			lp[x] = 30 + 0.01*y + 0.002*((y%SWATH_SIZE) - 4.5)*edge;
+		}
+	}
+}
+
+// Make nband bands of smooth scaled integers around mean with some noise.
+static void
+makebands(Mat &m, int nband, int mean)
+{
+	m.create(nband*HEIGHT, WIDTH, CV_16UC1);
+	for(int i = 0; i < m.rows; i++) {
+		unsigned short *p = m.ptr<unsigned short>(i);
+		for(int x = 0; x < WIDTH; x++)
+			p[x] = mean + (int)(1000*sin(0.01*i) + 500*cos(0.005*x)) + (i*7919 + x*104729)%40;
+	}
+}
+
+static void
+bench_init(Bench &b, int nband)
+{
+	b.nband = nband;
+	makelat(b.lat);
+	resample_init(b.r, b.lat, false);
+	getsortingind(b.sind, HEIGHT/SWATH_SIZE);
+	makebands(b.ref, nband, 3000);
+	makebands(b.emi, nband, 4000);
+	b.out.create(nband*HEIGHT, WIDTH, CV_16UC1);
+	b.mask.create(nband, MASKBYTES(HEIGHT*WIDTH), CV_8UC1);
+	b.img = allocate_2d_f(HEIGHT, WIDTH*nband);
+	for(int i = 0; i < nband; i++) {
+		convert_init(b.conv[i], EMISSIVE, true, false, b.emi.ptr<unsigned short>(i*HEIGHT),
+			HEIGHT*WIDTH, 1500, 8e-4);
+	}
+}
+
+// Float image wrapping b.img.
+static Mat
+imgmat(Bench &b)
+{
+	return Mat(HEIGHT, WIDTH*b.nband, CV_32FC1, &b.img[0][0]);
+}
+
+// Converts or converts back each band of a Bench in its own thread.
+class ConvertBody : public ParallelLoopBody {
+	Bench &b;
+	int op;
+public:
+	ConvertBody(Bench &_b, int _op) : b(_b), op(_op) {}
+
+	void operator()(const Range &bands) const {
+		for(int i = bands.start; i < bands.end; i++) {
+			unsigned short *ref = b.ref.ptr<unsigned short>(i*HEIGHT);
+			unsigned short *emi = b.emi.ptr<unsigned short>(i*HEIGHT);
+			unsigned short *out = b.out.ptr<unsigned short>(i*HEIGHT);
+			unsigned char *mask = b.mask.ptr<unsigned char>(i);
+
+			switch(op) {
+			case 0:
+				int2ref(WIDTH, HEIGHT, ref, 0, 5e-5, b.img, i);
+				break;
+			case 1:
+				ref2int(WIDTH, HEIGHT, b.img, 0, 5e-5, out, i);
+				break;
+			case 2:
+				int2bt(EMISSIVE, WIDTH, HEIGHT, emi, 1500, 8e-4, mask, b.img, i, false);
+				break;
+			case 3:
+				bt2int(EMISSIVE, WIDTH, HEIGHT, b.img, 1500, 8e-4, mask, out, i, false);
+				break;
+			}
+		}
+	}
+};
+
+static void
+run_getsortingind(Bench &b)
+{
+	getsortingind(b.sind, HEIGHT/SWATH_SIZE);
+}
+
+static void
+run_sortind_init(Bench &b)
+{
+	sortind_init(b.r.sind, b.sind);
+}
+
+static void
+run_resample_sort(Bench &b)
+{
+	resample_sort(b.r.sind, imgmat(b), b.simg);
+}
+
+static void
+run_resample2d(Bench &b)
+{
+	resample2d(b.simg, b.r.lam, b.r.sind, b.dst);
+}
+
+static void
+run_resample_unsort(Bench &b)
+{
+	resample_unsort(b.r.sind, b.dst, b.uimg);
+}
+
+static void
+run_setoverlaps1km(Bench &b)
+{
+	Mat img = imgmat(b);
+
+	setoverlaps1km(img, NAN);
+}
+
+static void
+run_int2ref(Bench &b)
+{
+	parallel_for_(Range(0, b.nband), ConvertBody(b, 0));
+}
+
+static void
+run_ref2int(Bench &b)
+{
+	parallel_for_(Range(0, b.nband), ConvertBody(b, 1));
+}
+
+static void
+run_int2bt(Bench &b)
+{
+	parallel_for_(Range(0, b.nband), ConvertBody(b, 2));
+}
+
+static void
+run_bt2int(Bench &b)
+{
+	parallel_for_(Range(0, b.nband), ConvertBody(b, 3));
+}
+
+static void
+run_resample_bands16(Bench &b)
+{
+	resample_bands16(b.r, b.emi.ptr<unsigned short>(0), b.out.ptr<unsigned short>(0),
+		b.nband, b.conv, false, false, NULL);
+}
+
+// The kernels in the order they are run. Each kernel runs on the
+// output of the ones before it. Kernels that work on all bands process
+// nband times as many pixels.
+static struct {
+	const char	*name;
+	void	(*run)(Bench &b);
+	bool	allbands;
+} kernels[] = {
+	{"getsortingind", run_getsortingind, false},
+	{"sortind_init", run_sortind_init, false},
+	{"int2ref", run_int2ref, true},
+	{"ref2int", run_ref2int, true},
+	{"int2bt", run_int2bt, true},
+	{"resample_sort", run_resample_sort, true},
+	{"resample2d", run_resample2d, true},
+	{"resample_unsort", run_resample_unsort, true},
+	{"bt2int", run_bt2int, true},
+	{"setoverlaps1km", run_setoverlaps1km, true},
+	{"resample_bands16", run_resample_bands16, true},
+};
+
+// Read the results saved by writebaseline from path into res.
+// Returns the number of results, or -1 if path cannot be opened.
+static int
+readbaseline(const char *path, Result *res, int *nband)
+{
+	FILE *f;
+	char line[256];
+	int n;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	n = 0;
+	*nband = 0;
+	// this only reads the one key per line format written below
+	while(fgets(line, sizeof line, f) != NULL && n < MAXRESULT) {
+		if(sscanf(line, " \"nband\": %d", nband) == 1)
+			continue;
+		if(sscanf(line, " \"%63[^\"]\": %lf", res[n].key, &res[n].mpix) == 2
+		&& strchr(res[n].key, '/') != NULL)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+// Save the results res as JSON to path.
+static void
+writebaseline(const char *path, const Result *res, int nres, int nband)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if(f == NULL)
+		eprintf("cannot create %s:", path);
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"width\": %d,\n", WIDTH);
+	fprintf(f, "\t\"height\": %d,\n", HEIGHT);
+	fprintf(f, "\t\"nband\": %d,\n", nband);
+	fprintf(f, "\t\"results\": {\n");
+	for(int i = 0; i < nres; i++)
+		fprintf(f, "\t\t\"%s\": %.1f%s\n", res[i].key, res[i].mpix, i < nres-1 ? "," : "");
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n");
+	if(fclose(f) != 0)
+		eprintf("cannot write %s:", path);
+}
+
+// Returns the baseline result with key, or NULL.
+static const Result*
+findresult(const Result *res, int nres, const char *key)
+{
+	for(int i = 0; i < nres; i++) {
+		if(strcmp(res[i].key, key) == 0)
+			return &res[i];
+	}
+	return NULL;
+}
+
+// Parse the comma separated list of thread counts s into nthreads.
+// Returns the number of thread counts.
+static int
+parsethreads(char *s, int *nthreads, int max)
+{
+	int n = 0;
+
+	for(char *p = strtok(s, ","); p != NULL && n < max; p = strtok(NULL, ",")) {
+		nthreads[n] = atoi(p);
+		if(nthreads[n] < 1)
+			return 0;
+		n++;
+	}
+	return n;
+}
+
+static void
+usage()
+{
+	printf("usage: %s [flags]\n", progname);
+	printf("\n");
+	printf("Time the resampling and conversion kernels on a synthetic %dx%d granule\n", WIDTH, HEIGHT);
+	printf("and report their throughput in MPix/s for each number of threads.\n");
+	printf("\n");
+	printf("	-b baseline.json\n");
+	printf("		compare with the results saved in baseline.json and exit\n");
+	printf("		with status 1 if a kernel is slower or missing from it,\n");
+	printf("		as with other numbers of threads; it is an error if\n");
+	printf("		baseline.json does not exist\n");
+	printf("	-w	save the results to baseline.json instead of comparing\n");
+	printf("	-t pct	tolerate kernels up to pct percent slower (default 15)\n");
+	printf("	-j n,n,...\n");
+	printf("		numbers of threads to run (default 1, 2, 4, ... up to the\n");
+	printf("		number of CPUs)\n");
+	printf("	-n n	number of bands (default 4)\n");
+	printf("	-r n	number of runs of each kernel; the fastest counts (default 5)\n");
+	printf("	-h	print this help\n");
+	exit(2);
+}
+
+#define GETARG(x)	do{\
+		(x) = *argv++;\
+		argc--;\
+	}while(0);
+
+int
+main(int argc, char** argv)
+{
+	char *flag;
+	const char *basepath = NULL;
+	bool writebase = false;
+	double tol = 15;
+	int nthreads[32], nnthreads = 0;
+	int nband = 4, nrun = 5;
+	Result res[MAXRESULT], base[MAXRESULT];
+	int nres, nbase, basenband, nslow, nmissing;
+	Bench b;
+
+	GETARG(progname);
+	while(argc > 0 && strlen(argv[0]) == 2 && argv[0][0] == '-') {
+		GETARG(flag);
+		if(flag[1] != 'w' && flag[1] != 'h' && argc < 1)
+			usage();
+
+		switch(flag[1]) {
+		default:
+		case 'h':
+			usage();
+			break;
+		case 'b':
+			GETARG(basepath);
+			break;
+		case 'w':
+			writebase = true;
+			break;
+		case 't':
+			GETARG(flag);
+			tol = atof(flag);
+			break;
+		case 'j':
+			GETARG(flag);
+			nnthreads = parsethreads(flag, nthreads, nelem(nthreads));
+			if(nnthreads == 0)
+				usage();
+			break;
+		case 'n':
+			GETARG(flag);
+			nband = atoi(flag);
+			if(nband < 1 || nband > (int)nelem(b.conv))
+				usage();
+			break;
+		case 'r':
+			GETARG(flag);
+			nrun = atoi(flag);
+			if(nrun < 1)
+				usage();
+			break;
+		}
+	}
+	if(argc != 0 || (writebase && basepath == NULL))
+		usage();
+	if(nnthreads == 0) {
+		for(int n = 1; n < getNumberOfCPUs() && nnthreads < (int)nelem(nthreads)-1; n *= 2)
+			nthreads[nnthreads++] = n;
+		nthreads[nnthreads++] = getNumberOfCPUs();
+	}
+
+	nbase = -1;
+	if(basepath != NULL && !writebase) {
+		nbase = readbaseline(basepath, base, &basenband);
+		if(nbase >= 0 && basenband != nband) {
+			eprintf("baseline %s has %d bands, not %d; save a new one with -w",
+				basepath, basenband, nband);
+		} else if(nbase < 0) {
+			eprintf("cannot read baseline %s; save one with -w", basepath);
+		}
+	}
+
+	bench_init(b, nband);
+	printf("%d bands of %dx%d pixels, fastest of %d runs\n", nband, WIDTH, HEIGHT, nrun);
+	printf("%-18s %7s %9s %9s %9s\n", "kernel", "threads", "ms", "MPix/s", "baseline");
+
+	nres = 0;
+	nslow = 0;
+	nmissing = 0;
+	for(int t = 0; t < nnthreads; t++) {
+		setNumThreads(nthreads[t]);
+		for(int k = 0; k < (int)nelem(kernels) && nres < MAXRESULT; k++) {
+			double best = HUGE_VAL;
+			double npix = (double)WIDTH*HEIGHT*(kernels[k].allbands ? nband : 1);
+
+			for(int i = 0; i < nrun; i++) {
+				double t0 = nowsec();
+				kernels[k].run(b);
+				double sec = nowsec() - t0;
+				if(sec < best)
+					best = sec;
+			}
+			Result &r = res[nres++];
+			snprintf(r.key, sizeof r.key, "%s/%d", kernels[k].name, nthreads[t]);
+			r.mpix = npix / best / 1e6;
+
+			printf("%-18s %7d %9.2f %9.1f", kernels[k].name, nthreads[t], best*1e3, r.mpix);
+			const Result *br = nbase >= 0 ? findresult(base, nbase, r.key) : NULL;
+			if(br != NULL) {
+				printf(" %9.1f %+6.1f%%", br->mpix, 100*(r.mpix/br->mpix - 1));
+				if(r.mpix < br->mpix*(1 - tol/100)) {
+					printf(" SLOWER");
+					nslow++;
+				}
+			} else if(nbase >= 0) {
+				printf(" %9s MISSING", "-");
+				nmissing++;
+			}
+			printf("\n");
+		}
+	}
+
+	if(writebase) {
+		writebaseline(basepath, res, nres, nband);
+		printf("saved results to %s\n", basepath);
+	}
+	if(nslow > 0)
+		printf("%d kernels are more than %g%% slower than %s\n", nslow, tol, basepath);
+	if(nmissing > 0)
+		printf("%d kernels are missing from %s; save a new one with -w\n", nmissing, basepath);
+	return nslow > 0 || nmissing > 0 ? 1 : 0;
+}
@@ -0,0 +1,1020 @@
+//
+// Conversion between scaled integers and physical values
+//
+
+#include <math.h>
+#include "modisresam.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+// k = Boltzmann gas constant (joules/Kelvin)
+const float k_Boltz = 1.3806488e-23;
+// h = Planck’s constant (joule * second)
+const float h_Planck = 6.62606957e-34;
+// c = speed of light in vacuum (m/s)
+const float c_light = 299792458.0;
+
+// define array of wavelengths and assign correct values for emissive bands
+double lambda[38] = {
+	0,	// 0
+	0,	// 1
+	0,	// 2
+	0,	// 3
+	0,	// 4
+	0,	// 5
+	0,	// 6
+	0,	// 7
+	0,	// 8
+	0,	// 9
+	0,	// 10
+	0,	// 11
+	0,	// 12
+	0,	// 13
+	0,	// 14
+	0,	// 15
+	0,	// 16
+	0,	// 17
+	0,	// 18
+	0,	// 19
+	0,	// 20
+	0,	// 21
+	0.5*( 3.660 +  3.840)*1.0E-6, // 22. band 20
+	0.5*( 3.929 +  3.989)*1.0E-6, // 23. band 21
+	0.5*( 3.929 +  3.989)*1.0E-6, // 24. band 22
+	0.5*( 4.020 +  4.080)*1.0E-6, // 25. band 23
+	0.5*( 4.433 +  4.498)*1.0E-6, // 26. band 24
+	0.5*( 4.482 +  4.549)*1.0E-6, // 27. band 25
+	0.5*( 6.535 +  6.895)*1.0E-6, // 28. band 27 (sic)
+	0.5*( 7.175 +  7.475)*1.0E-6, // 29. band 28
+	0.5*( 8.400 +  8.700)*1.0E-6, // 30. band 29
+	0.5*( 9.580 +  9.880)*1.0E-6, // 31. band 30
+	0.5*(10.780 + 11.280)*1.0E-6, // 32. band 31
+	0.5*(11.770 + 12.270)*1.0E-6, // 33. band 32
+	0.5*(13.185 + 13.485)*1.0E-6, // 34. band 33
+	0.5*(13.485 + 13.785)*1.0E-6, // 35. band 34
+	0.5*(13.785 + 14.085)*1.0E-6, // 36. band 35
+	0.5*(14.085 + 14.385)*1.0E-6, // 37. band 36
+};
+
+// Returns the 8 bits of the packed mask m starting at bit i. All 8
+// bits must lie within the mask.
+static inline int
+mask8(const unsigned char *m, long i)
+{
+	int b = m[i>>3] >> (i&7);
+
+	if(i&7)
+		b |= m[(i>>3)+1] << (8-(i&7));
+	return b & 0xff;
+}
+
+#ifdef HAVE_AVX2
+
+// The AVX2 kernels below convert a row of pixels 8 at a time. Several
+// bands are interleaved by line in the physical values, so each row is
+// converted separately; the last n%8 pixels of a row go through the
+// same vector code using a padded copy.
+//
+// int2ref_row_avx2 and ref2int_row_avx2 compute exactly the same float
+// expressions as the scalar code. int2bt_row_avx2 and bt2int_row_avx2
+// replace log and exp with the polynomial approximations of log8 and
+// exp8 and are only used for the fast conversion. Over the full 16-bit
+// range of every emissive band, the brightness temperatures of the
+// fast conversion differ from the exact ones by at most 2 ulp
+// (6e-5 K), and converting them back gives the original integers. A
+// resampled pixel whose value lies right next to a rounding boundary
+// may differ by 1 DN from the exact conversion.
+
+// Natural logarithm of 8 positive finite floats, after Cephes logf.
+// The relative error is below 2.5e-7.
+__attribute__((target("avx2")))
+static inline __m256
+log8(__m256 x)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256i xi, ei;
+	__m256 e, m, small, z, y;
+
+	// x = m * 2^e with m in [0.5, 1)
+	xi = _mm256_castps_si256(x);
+	ei = _mm256_sub_epi32(_mm256_srli_epi32(xi, 23), _mm256_set1_epi32(126));
+	m = _mm256_castsi256_ps(_mm256_or_si256(
+		_mm256_and_si256(xi, _mm256_set1_epi32(0x007fffff)),
+		_mm256_set1_epi32(0x3f000000)));
+	e = _mm256_cvtepi32_ps(ei);
+
+	// move m into [sqrt(0.5), sqrt(2)) and subtract 1
+	small = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+	e = _mm256_sub_ps(e, _mm256_and_ps(small, one));
+	m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(small, m));
+
+	z = _mm256_mul_ps(m, m);
+	y = _mm256_set1_ps(7.0376836292E-2f);
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.1514610310E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.1676998740E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.2420140846E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.4249322787E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.6668057665E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(2.0000714765E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-2.4999993993E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(3.3333331174E-1f));
+	y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+	y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+	y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+	return _mm256_add_ps(_mm256_add_ps(m, y), _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+}
+
+// Exponential of 8 floats, after Cephes expf.
+// The relative error is below 2.5e-7.
+__attribute__((target("avx2")))
+static inline __m256
+exp8(__m256 x)
+{
+	__m256 fx, z, y;
+	__m256i n;
+
+	x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+	x = _mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f));
+
+	// x = n*log(2) + r with |r| <= log(2)/2
+	fx = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+		_mm256_set1_ps(0.5f)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440e-4f)));
+
+	z = _mm256_mul_ps(x, x);
+	y = _mm256_set1_ps(1.9875691500E-4f);
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507E-3f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073E-3f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894E-2f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459E-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201E-1f));
+	y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, z), x), _mm256_set1_ps(1.0f));
+
+	// multiply by 2^n
+	n = _mm256_cvttps_epi32(fx);
+	n = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+}
+
+// Round 8 floats half away from zero like round() and convert them
+// to integers. Values that do not fit in an int become INT_MIN.
+__attribute__((target("avx2")))
+static inline __m256i
+round8(__m256 v)
+{
+	// largest float below 0.5, so that v + h never rounds up
+	// to the next integer when v is just below a half
+	const __m256 h = _mm256_set1_ps(0.49999997f);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+
+	return _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_or_ps(h, _mm256_and_ps(v, sign))));
+}
+
+// Lane i is all ones where bit i of the 8 mask bits m is set, the
+// inverse of _mm256_movemask_ps.
+__attribute__((target("avx2")))
+static inline __m256i
+expand8(int m)
+{
+	const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(m), bits), bits);
+}
+
+// Store the 8 integers j in [0, 65535] to out as unsigned shorts,
+// except where keep is set.
+__attribute__((target("avx2")))
+static inline void
+store8u16(unsigned short *out, __m256i j, __m256i keep)
+{
+	__m128i v, k, o;
+
+	v = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(j, j), 0x08));
+	k = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packs_epi32(keep, keep), 0x08));
+	o = _mm_loadu_si128((const __m128i*)out);
+	_mm_storeu_si128((__m128i*)out, _mm_blendv_epi8(v, o, k));
+}
+
+// Clamp the integers j that are outside [0, 65535] to 65535 and add
+// their number to *nclamped like the scalar code does, except where
+// keep is set.
+__attribute__((target("avx2")))
+static inline __m256i
+checkrange8(__m256i j, __m256i keep, int *nclamped)
+{
+	__m256i bad;
+
+	bad = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), j),
+		_mm256_cmpgt_epi32(j, _mm256_set1_epi32(65535)));
+	bad = _mm256_andnot_si256(keep, bad);
+	if(_mm256_testz_si256(bad, bad))
+		return j;
+
+	*nclamped += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(bad)));
+	return _mm256_blendv_epi8(j, _mm256_set1_epi32(65535), bad);
+}
+
+__attribute__((target("avx2")))
+static inline __m256
+bt8(__m256i j, __m256 offset, __m256 scale, __m256 r1, __m256 r2)
+{
+	__m256 rad;
+
+	// scale integers to physical radiance values
+	rad = _mm256_mul_ps(scale, _mm256_sub_ps(_mm256_cvtepi32_ps(j), offset));
+
+	// calculate Brightness Temperature from Radiance
+	return _mm256_div_ps(r1, log8(_mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_div_ps(r2, rad))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+btint8(__m256 bt, __m256 offset, __m256 scale, __m256 r1, __m256 r2)
+{
+	__m256 z;
+
+	// get the radiance from brightness temperature
+	z = _mm256_div_ps(r2, _mm256_sub_ps(exp8(_mm256_div_ps(r1, bt)), _mm256_set1_ps(1.0f)));
+
+	// scale the radiance back to integer
+	return round8(_mm256_add_ps(_mm256_div_ps(z, scale), offset));
+}
+
+// Mask the pixels of buff1 with no physical radiance and find the
+// smallest integer of the other pixels and the largest integer.
+__attribute__((target("avx2")))
+static int
+findrange_avx2(const unsigned short *buff1, int n, float offset, unsigned char *maskNaN, int *jmin, int *jmax)
+{
+	const __m256 voff = _mm256_set1_ps(offset);
+	__m256i vmin, vmax, vmask, j, neg;
+	int ix, nmask, mins[8], maxs[8], masks[8];
+
+	vmin = _mm256_set1_epi32(65535);
+	vmax = vmask = _mm256_setzero_si256();
+	for(ix=0; ix+8<=n; ix+=8) {
+		j = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&buff1[ix]));
+		neg = _mm256_castps_si256(_mm256_cmp_ps(_mm256_cvtepi32_ps(j), voff, _CMP_LE_OQ));
+		if(maskNaN != NULL)
+			maskNaN[ix>>3] = _mm256_movemask_ps(_mm256_castsi256_ps(neg));
+		vmask = _mm256_sub_epi32(vmask, neg);
+		vmin = _mm256_min_epi32(vmin, _mm256_blendv_epi8(j, _mm256_set1_epi32(65535), neg));
+		vmax = _mm256_max_epi32(vmax, j);
+	}
+	_mm256_storeu_si256((__m256i*)mins, vmin);
+	_mm256_storeu_si256((__m256i*)maxs, vmax);
+	_mm256_storeu_si256((__m256i*)masks, vmask);
+	nmask = 0;
+	for(int i = 0; i < 8; i++) {
+		nmask += masks[i];
+		if(mins[i] < *jmin)
+			*jmin = mins[i];
+		if(maxs[i] > *jmax)
+			*jmax = maxs[i];
+	}
+	if(maskNaN != NULL && ix<n)
+		maskNaN[ix>>3] = 0;
+	for(; ix<n; ix++) {
+		if(buff1[ix]>*jmax)
+			*jmax = buff1[ix];
+		if(buff1[ix] <= offset) {
+			if(maskNaN != NULL)
+				maskNaN[ix>>3] |= 1<<(ix&7);
+			nmask++;
+			continue;
+		}
+		if(buff1[ix]<*jmin)
+			*jmin = buff1[ix];
+	}
+	return nmask;
+}
+
+__attribute__((target("avx2")))
+static void
+int2bt_row_avx2(const unsigned short *in, float *out, int n, int jmin,
+	float offset, float scale, float r1, float r2)
+{
+	const __m256 voff = _mm256_set1_ps(offset), vscale = _mm256_set1_ps(scale);
+	const __m256 vr1 = _mm256_set1_ps(r1), vr2 = _mm256_set1_ps(r2);
+	const __m256i vjmin = _mm256_set1_epi32(jmin);
+	__m256i j;
+	int x;
+
+	for(x=0; x+8<=n; x+=8) {
+		// pixels below the smallest physical radiance are set to it
+		j = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&in[x]));
+		j = _mm256_max_epi32(j, vjmin);
+		_mm256_storeu_ps(&out[x], bt8(j, voff, vscale, vr1, vr2));
+	}
+	if(x < n) {
+		int tj[8];
+		float tbt[8];
+		for(int i = 0; i < 8; i++) {
+			tj[i] = jmin;
+			if(x+i < n && in[x+i] > jmin)
+				tj[i] = in[x+i];
+		}
+		j = _mm256_loadu_si256((const __m256i*)tj);
+		_mm256_storeu_ps(tbt, bt8(j, voff, vscale, vr1, vr2));
+		for(int i = 0; x+i < n; i++)
+			out[x+i] = tbt[i];
+	}
+}
+
+// Pixels whose bit is set in the packed mask, starting at bit m0, are
+// left unchanged in out. Returns the number of integers clamped to 65535.
+__attribute__((target("avx2")))
+static int
+bt2int_row_avx2(const float *in, const unsigned char *mask, long m0, unsigned short *out, int n,
+	float offset, float scale, float r1, float r2)
+{
+	const __m256 voff = _mm256_set1_ps(offset), vscale = _mm256_set1_ps(scale);
+	const __m256 vr1 = _mm256_set1_ps(r1), vr2 = _mm256_set1_ps(r2);
+	__m256i j, keep;
+	int x, nclamped = 0;
+
+	for(x=0; x+8<=n; x+=8) {
+		// preserve the original data of pixels with negative radiance
+		keep = expand8(mask8(mask, m0+x));
+		j = btint8(_mm256_loadu_ps(&in[x]), voff, vscale, vr1, vr2);
+		store8u16(&out[x], checkrange8(j, keep, &nclamped), keep);
+	}
+	if(x < n) {
+		float tbt[8];
+		int tkeep[8];
+		unsigned short tout[8];
+		for(int i = 0; i < 8; i++) {
+			tbt[i] = x+i < n ? in[x+i] : 300;
+			tkeep[i] = x+i < n && MASKGET(mask, m0+x+i) ? -1 : 0;
+			tout[i] = x+i < n ? out[x+i] : 0;
+		}
+		keep = _mm256_loadu_si256((const __m256i*)tkeep);
+		j = btint8(_mm256_loadu_ps(tbt), voff, vscale, vr1, vr2);
+		store8u16(tout, checkrange8(j, keep, &nclamped), keep);
+		for(int i = 0; x+i < n; i++)
+			out[x+i] = tout[i];
+	}
+	return nclamped;
+}
+
+// int2ref_row_avx2 and ref2int_row_avx2 return the number of pixels
+// converted; the caller converts the rest. ref2int_row_avx2 adds the
+// number of integers clamped to 65535 to *nclamped.
+__attribute__((target("avx2")))
+static int
+int2ref_row_avx2(const unsigned short *in, float *out, int n, float offset, float scale)
+{
+	const __m256 voff = _mm256_set1_ps(offset), vscale = _mm256_set1_ps(scale);
+	__m256 v;
+	int x;
+
+	for(x=0; x+8<=n; x+=8) {
+		v = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&in[x])));
+		_mm256_storeu_ps(&out[x], _mm256_mul_ps(vscale, _mm256_sub_ps(v, voff)));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static int
+ref2int_row_avx2(const float *in, unsigned short *out, int n, float offset, float scale,
+	int *nclamped)
+{
+	const __m256 voff = _mm256_set1_ps(offset), vscale = _mm256_set1_ps(scale);
+	const __m256i none = _mm256_setzero_si256();
+	__m256i j;
+	int x;
+
+	for(x=0; x+8<=n; x+=8) {
+		// scale the reflectance back to integer
+		j = round8(_mm256_add_ps(_mm256_div_ps(_mm256_loadu_ps(&in[x]), vscale), voff));
+		store8u16(&out[x], checkrange8(j, none, nclamped), none);
+	}
+	return x;
+}
+
+#endif // HAVE_AVX2
+
+// Brightness temperature of the scaled integer j.
+static inline float
+int2bt1(int j, float offset, float scale, float r1, float r2)
+{
+	float rad;
+
+	// scale integers to physical radiance values
+	rad = scale*(j - offset);
+
+	// calculate Brightness Temperature from Radiance
+	return r1/log(1.0 + r2/rad);
+}
+
+// Scaled integer of the brightness temperature bt, before rounding.
+static inline float
+bt2int1(float bt, float offset, float scale, float r1, float r2)
+{
+	float z;
+
+	// get the radiance from brightness temperature
+	z = r2/(exp(r1/bt) - 1.0);
+
+	// scale the radiance back to integer
+	return z/scale + offset;
+}
+
+// Converts v to an integer in [lo, hi].
+static inline int
+clampint(float v, int lo, int hi)
+{
+	if(!(v > lo))
+		return lo;
+	if(v > hi)
+		return hi;
+	return (int) v;
+}
+
+static inline float
+bits2float(uint32_t u)
+{
+	float f;
+
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static inline uint32_t
+float2bits(float f)
+{
+	uint32_t u;
+
+	memcpy(&u, &f, sizeof(u));
+	return u;
+}
+
+// Whether the brightness temperature with bit pattern u is converted
+// to an integer >= k.
+static inline bool
+atleast(uint32_t u, int k, float offset, float scale, float r1, float r2)
+{
+	return round(bt2int1(bits2float(u), offset, scale, r1, r2)) >= k;
+}
+
+// Returns the smallest non-negative brightness temperature that is
+// converted to an integer >= k. The conversion is monotone in the
+// brightness temperature, and so are the bit patterns of non-negative
+// floats, so the result is found by searching the bit patterns. The
+// search starts from the inverse of the unrounded conversion at k-0.5
+// and only takes a few steps.
+static float
+btthreshold(int k, float offset, float scale, float r1, float r2)
+{
+	const uint32_t inf = float2bits(INFINITY);
+	uint32_t lo, hi, step, mid;
+	float guess;
+
+	guess = r1/log(1.0 + r2/(scale*(k - 0.5f - offset)));
+	if(!(guess > 0 && guess < INFINITY))
+		guess = 1.0f;
+
+	// find lo, hi such that lo is below the result and hi is not
+	hi = lo = float2bits(guess);
+	if(atleast(hi, k, offset, scale, r1, r2)) {
+		for(step = 1; ; step *= 2) {
+			if(hi < step) {
+				if(atleast(0, k, offset, scale, r1, r2))
+					return 0.0f;
+				lo = 0;
+				break;
+			}
+			lo = hi - step;
+			if(!atleast(lo, k, offset, scale, r1, r2))
+				break;
+			hi = lo;
+		}
+	} else {
+		for(step = 1; ; step *= 2) {
+			if(inf - lo <= step) {
+				// infinity is converted to an infinite integer
+				hi = inf;
+				break;
+			}
+			hi = lo + step;
+			if(atleast(hi, k, offset, scale, r1, r2))
+				break;
+			lo = hi;
+		}
+	}
+
+	while(hi - lo > 1) {
+		mid = lo + (hi - lo)/2;
+		if(atleast(mid, k, offset, scale, r1, r2))
+			hi = mid;
+		else
+			lo = mid;
+	}
+	return bits2float(hi);
+}
+
+// Scaled integer of the brightness temperature bt. Integers outside
+// the valid range are replaced by 65535 and counted in *nclamped.
+static inline int
+bt2intpix(float bt, float offset, float scale, float r1, float r2, int *nclamped)
+{
+	int j;
+
+	j = (int) round(bt2int1(bt, offset, scale, r1, r2));
+
+	// check that integer is within valid bounds
+	if((j<0) || (j>65535)) {
+		(*nclamped)++;
+		j = 65535;
+	}
+	return j;
+}
+
+// Scaled integer of the reflectance v. Integers outside the valid
+// range are replaced by 65535 and counted in *nclamped.
+static inline int
+ref2intpix(float v, float offset, float scale, int *nclamped)
+{
+	int j;
+
+	// scale the reflectance back to integer
+	j = (int) round(v/scale + offset);
+
+	// check that integer is within valid bounds
+	if((j<0) || (j>65535)) {
+		(*nclamped)++;
+		j = 65535;
+	}
+	return j;
+}
+
+// Mask the pixels of buff1 with no physical radiance and find the
+// smallest integer of the other pixels and the largest integer.
+//
+// buff1 -- input image (1d)
+// n -- number of pixels
+// offset -- offset value for this band
+// maskNaN -- packed mask of pixels with negative radiance, MASKBYTES(n)
+//	bytes (preallocated output), may be NULL
+// jmin, jmax -- smallest and largest integer (output)
+//
+// Returns the number of pixels with negative radiances.
+//
+static int
+findrange(const unsigned short *buff1, int n, float offset, unsigned char *maskNaN, int *jmin, int *jmax)
+{
+	int ix, nmask;
+
+	*jmin = 65535;
+	*jmax = 0;
+#ifdef HAVE_AVX2
+	if(haveavx2())
+		return findrange_avx2(buff1, n, offset, maskNaN, jmin, jmax);
+#endif
+	nmask = 0;
+	for(ix=0; ix<n; ix++) {
+		if(buff1[ix]>*jmax) {
+			*jmax = buff1[ix];
+		}
+		if(maskNaN != NULL && (ix&7) == 0) {
+			maskNaN[ix>>3] = 0;   // originally assume data are physically valid
+		}
+
+		if(buff1[ix] <= offset) {
+			// found a pixel with negative radiance
+			if(maskNaN != NULL) {
+				maskNaN[ix>>3] |= 1<<(ix&7);  // set the mask for unphysical data
+			}
+			nmask++;              // count such pixels
+			continue;
+		}
+
+		// update minimum physical radiance - used later as fill in value for unphysical values
+		if(buff1[ix]<*jmin) {
+			*jmin = buff1[ix];
+		}
+	}
+	return nmask;
+}
+
+// Start setting up the conversion c of band is. The range of the
+// integers of the band is then added with convert_scan, and the setup
+// is finished by convert_tables.
+//
+// is -- band number
+// emissive -- convert to brightness temperature instead of reflectance
+// fast -- use the vectorized approximations of log and exp if available
+// offset -- offset value for this band
+// scale -- scale factor for this band
+//
+void
+convert_setup(BandConv &c, int is, bool emissive, bool fast, float offset, float scale)
+{
+	c.emissive = emissive;
+	c.fast = fast;
+	c.offset = offset;
+	c.scale = scale;
+	c.r1 = c.r2 = 0;
+	c.jmin = 65535;
+	c.jmax = 0;
+	if(!emissive) {
+		return;
+	}
+
+	c.r1 = h_Planck*c_light/(k_Boltz*lambda[is]);
+	c.r2 = lambda[is];
+	c.r2 = 1.0e-6*(2.0*h_Planck*c_light*c_light)/(c.r2*c.r2*c.r2*c.r2*c.r2);
+}
+
+// The brightness temperature only depends on the integer, so it is
+// computed once for each integer in [c.jmin, jmax] instead of once
+// for each pixel.
+static void
+btlut_init(BandConv &c, int jmax)
+{
+	if(jmax < c.jmin) {
+		jmax = c.jmin;
+	}
+	c.btlut.create(1, jmax-c.jmin+1, CV_32FC1);
+	float *lut = (float*)c.btlut.data - c.jmin;
+	for(int j=c.jmin; j<=jmax; j++) {
+		lut[j] = int2bt1(j, c.offset, c.scale, c.r1, c.r2);
+	}
+}
+
+// Set up the conversion of brightness temperatures in [btmin, btmax]
+// back to integers by looking them up in a table of the smallest
+// brightness temperature of each integer. This gives exactly the same
+// result as converting each pixel. Pixels outside the range of the
+// table are converted directly.
+static void
+btinv_init(BandConv &c, float btmin, float btmax)
+{
+	int j;
+
+	if(!(btmin > 0 && btmin <= btmax && btmax < INFINITY)) {
+		// no table, all pixels are converted directly
+		c.a = c.nt = 0;
+		c.thr.create(1, 2, CV_32FC1);
+		c.thr = Scalar(INFINITY);
+		c.bucket = Mat::zeros(1, 1, CV_32SC1);
+		c.base = c.inv = 0;
+		return;
+	}
+	int jlo = clampint(round(bt2int1(btmin, c.offset, c.scale, c.r1, c.r2)), -1, 65536);
+	int jhi = clampint(round(bt2int1(btmax, c.offset, c.scale, c.r1, c.r2)), -1, 65536);
+	int a = clampint(jlo, 0, 65535);
+	int b = clampint(jhi, 0, 65535);
+
+	// thr[j] is the threshold of integer a+j for j in [1, nt].
+	// thr[0] and thr[nt+1] bound the pixels with integers in [a, b],
+	// so that the pixels outside the table are converted directly.
+	int nt = b - a;
+	c.a = a;
+	c.nt = nt;
+	c.thr.create(1, nt+2, CV_32FC1);
+	float *thr = (float*)c.thr.data;
+	thr[0] = btthreshold(a, c.offset, c.scale, c.r1, c.r2);
+	for(j=1; j<=nt; j++) {
+		thr[j] = btthreshold(a+j, c.offset, c.scale, c.r1, c.r2);
+	}
+	thr[nt+1] = btthreshold(b+1, c.offset, c.scale, c.r1, c.r2);
+
+	// Index of the table by brightness temperature. The buckets are
+	// about as wide as the smallest gap between thresholds, so a
+	// lookup mostly needs a single comparison.
+	float gap = INFINITY;
+	for(j=1; j<nt; j++) {
+		if(thr[j+1] > thr[j] && thr[j+1] - thr[j] < gap)
+			gap = thr[j+1] - thr[j];
+	}
+	int nbucket = 1;
+	c.base = thr[nt < 1 ? 0 : 1];
+	c.inv = 0;
+	if(gap < INFINITY) {
+		nbucket = clampint((thr[nt] - thr[1])/gap, 1, 8*nt) + 1;
+		c.inv = (nbucket - 1)/(thr[nt] - thr[1]);
+	}
+	c.bucket.create(1, nbucket, CV_32SC1);
+	int *bucket = (int*)c.bucket.data;
+	for(int m=0, k=0; m<nbucket; m++) {
+		while(k < nt && (thr[k+1] - c.base)*c.inv <= m) k++;
+		bucket[m] = k;
+	}
+}
+
+// Scaled integer of the brightness temperature bt, using the table
+// set up by btinv_init. Integers outside the valid range are counted
+// in *nclamped.
+static inline int
+btinv(const BandConv &c, float bt, int *nclamped)
+{
+	const float *thr = (const float*)c.thr.data;
+
+	if(bt > 0 && bt >= thr[0] && bt < thr[c.nt+1]) {
+		// count the thresholds <= bt, starting from the index;
+		// thr[0] and thr[nt+1] stop the walk in either direction
+		int k = ((const int*)c.bucket.data)[clampint((bt - c.base)*c.inv, 0, c.bucket.cols-1)];
+		k -= thr[k] > bt;
+		k += thr[k+1] <= bt;
+		while(thr[k] > bt) k--;
+		while(thr[k+1] <= bt) k++;
+		return c.a + k;
+	}
+	return bt2intpix(bt, c.offset, c.scale, c.r1, c.r2, nclamped);
+}
+
+// Add the n integers in buff1 to the range of the band set up in c.
+// The image of the band can be scanned in any number of pieces.
+//
+// Returns the number of pixels with negative radiances.
+//
+int
+convert_scan(BandConv &c, const unsigned short *buff1, int n)
+{
+	int nmask, jmin, jmax;
+
+	if(!c.emissive) {
+		return 0;
+	}
+	nmask = findrange(buff1, n, c.offset, NULL, &jmin, &jmax);
+	c.jmin = MIN(c.jmin, jmin);
+	c.jmax = MAX(c.jmax, jmax);
+	return nmask;
+}
+
+// Finish setting up the conversion c after the whole image of the
+// band has been scanned.
+void
+convert_tables(BandConv &c)
+{
+	if(!c.emissive) {
+		return;
+	}
+	btlut_init(c, c.jmax);
+
+	// Resampled values are interpolated between converted values,
+	// so they lie in the range of the brightness temperature table.
+	const float *lut = (const float*)c.btlut.data;
+	btinv_init(c, lut[0], lut[c.btlut.cols-1]);
+}
+
+// Set up the conversion c of band is for converting rows with
+// convert_row and convert_row_back.
+//
+// is -- band number
+// emissive -- convert to brightness temperature instead of reflectance
+// fast -- use the vectorized approximations of log and exp if available
+// buff1 -- input image (1d)
+// n -- number of pixels
+// offset -- offset value for this band
+// scale -- scale factor for this band
+//
+// Returns the number of pixels with negative radiances.
+//
+int
+convert_init(BandConv &c, int is, bool emissive, bool fast, const unsigned short *buff1, int n,
+	float offset, float scale)
+{
+	int nmask;
+
+	convert_setup(c, is, emissive, fast, offset, scale);
+	nmask = convert_scan(c, buff1, n);
+	convert_tables(c);
+	return nmask;
+}
+
+// Convert a row of n integers in of the band set up in c to physical
+// values out. Emissive pixels with negative radiance are set to the
+// smallest physical radiance of the band.
+void
+convert_row(const BandConv &c, const unsigned short *in, float *out, int n)
+{
+	int x = 0, j;
+
+	if(c.emissive) {
+#ifdef HAVE_AVX2
+		if(c.fast && haveavx2()) {
+			int2bt_row_avx2(in, out, n, c.jmin, c.offset, c.scale, c.r1, c.r2);
+			return;
+		}
+#endif
+		const float *lut = (const float*)c.btlut.data - c.jmin;
+		for(x=0; x<n; x++) {
+			// if radiance less than smallest physical value, set it to fill in value
+			j = in[x];
+			if(j<c.jmin) {
+				j = c.jmin;
+			}
+			out[x] = lut[j];
+		}
+		return;
+	}
+
+#ifdef HAVE_AVX2
+	if(haveavx2())
+		x = int2ref_row_avx2(in, out, n, c.offset, c.scale);
+#endif
+	for(; x<n; x++) {
+		out[x] = c.scale*( ((float) (in[x])) - c.offset);
+	}
+}
+
+// Convert a row of n physical values in of the band set up in c back
+// to integers out. orig holds the original integers of the same
+// pixels; emissive pixels with negative radiance keep them. out may
+// be the same as orig. Values outside the range of the integers,
+// including the pixels that could not be resampled, are set to 65535.
+//
+// Returns the number of values set to 65535 that way.
+//
+int
+convert_row_back(const BandConv &c, const float *in, const unsigned short *orig, unsigned short *out, int n)
+{
+	int x = 0, nclamped = 0;
+
+	if(c.emissive) {
+#ifdef HAVE_AVX2
+		if(c.fast && haveavx2()) {
+			unsigned char mask[MASKBYTES(256)];
+			int jmin, jmax;
+			if(out != orig) {
+				memcpy(out, orig, n*sizeof(*out));
+			}
+			for(x=0; x<n; x+=256) {
+				int m = n-x < 256 ? n-x : 256;
+				findrange(&orig[x], m, c.offset, mask, &jmin, &jmax);
+				nclamped += bt2int_row_avx2(&in[x], mask, 0, &out[x], m,
+					c.offset, c.scale, c.r1, c.r2);
+			}
+			return nclamped;
+		}
+#endif
+		for(x=0; x<n; x++) {
+			// preserve the original data
+			// in case of unphysical negative radiance in original data (produces NaN in Brightness Temperature)
+			if(orig[x] <= c.offset) {
+				out[x] = orig[x];
+				continue;
+			}
+			out[x] = (unsigned short) btinv(c, in[x], &nclamped);
+		}
+		return nclamped;
+	}
+
+#ifdef HAVE_AVX2
+	if(haveavx2())
+		x = ref2int_row_avx2(in, out, n, c.offset, c.scale, &nclamped);
+#endif
+	for(; x<n; x++) {
+		out[x] = (unsigned short) ref2intpix(in[x], c.offset, c.scale, &nclamped);
+	}
+	return nclamped;
+}
+
+// Transfrom integers to radience and then to brightness temperature for emissive bands.
+//
+// is -- band number
+// nx -- number of columns
+// ny -- number of rows
+// buff1 -- input image (1d)
+// offset -- offset value for this band
+// scale -- scale factor for this band
+// maskNaN -- packed mask of pixels with negative radiance, MASKBYTES(nx*ny)
+//	bytes (preallocated output)
+// inp_img -- brightness temperature output (2d) (preallocated output)
+// ib -- index of this band among the bands interleaved by line in inp_img
+// fast -- use the vectorized approximation of log if available
+//
+// Returns the number of pixels with negative radiances.
+//
+int
+int2bt(int is, int nx, int ny, unsigned short *buff1, float offset, float scale,
+	unsigned char *maskNaN, float **inp_img, int ib, bool fast)
+{
+	BandConv c;
+	int nmask, jmax, iy;
+
+	convert_setup(c, is, true, fast, offset, scale);
+
+	// find the minimum valid radiance > 0, mask all pixels with radiance <= 0
+	nmask = findrange(buff1, nx*ny, offset, maskNaN, &c.jmin, &jmax);
+	btlut_init(c, jmax);
+
+	// convert radiance to brightness temperature
+	for(iy=0; iy<ny; iy++) {
+		convert_row(c, &buff1[iy*nx], &inp_img[iy][ib*nx], nx);
+	}
+	return nmask;
+}
+
+
+// convert output brightness temperature back to radiance and then back to integer
+//
+// is -- band number
+// nx -- number of columns
+// ny -- number of rows
+// outp_img -- brightness temperature image (2d)
+// offset -- offset value for this band
+// scale -- scale factor for this band
+// maskNaN -- packed mask of pixels with negative radiance from int2bt
+// buff1 -- output integers (preallocated output)
+// ib -- index of this band among the bands interleaved by line in outp_img
+// fast -- use the vectorized approximation of exp if available
+//
+// Returns the number of integers outside the valid range, which are
+// set to 65535.
+//
+int
+bt2int(int is, int nx, int ny, float **outp_img, float offset, float scale, const unsigned char *maskNaN, unsigned short *buff1,
+	int ib, bool fast)
+{
+	BandConv c;
+	int ix, iy, x, nclamped = 0;
+	float bt;
+
+	convert_setup(c, is, true, fast, offset, scale);
+
+#ifdef HAVE_AVX2
+	if(fast && haveavx2()) {
+		for(iy=0; iy<ny; iy++) {
+			nclamped += bt2int_row_avx2(&outp_img[iy][ib*nx], maskNaN, (long)iy*nx, &buff1[iy*nx], nx,
+				offset, scale, c.r1, c.r2);
+		}
+		return nclamped;
+	}
+#endif
+
+	// find the range of brightness temperatures to convert
+	float btmin = INFINITY, btmax = -INFINITY;
+	for(iy=0, ix=0; iy<ny; iy++)
+	for(x=0; x<nx; x++, ix++) {
+		bt = outp_img[iy][ib*nx + x];
+		if(MASKGET(maskNaN, ix) || !(bt > 0 && bt < INFINITY)) continue;
+		if(bt < btmin) btmin = bt;
+		if(bt > btmax) btmax = bt;
+	}
+	btinv_init(c, btmin, btmax);
+
+	for(iy=0, ix=0; iy<ny; iy++)
+	for(x=0; x<nx; x++, ix++) {
+		// preserve the original data
+		// in case of unphysical negative radiance in original data (produces NaN in Brightness Temperature)
+		if(MASKGET(maskNaN, ix)) continue;
+
+		buff1[ix] = (unsigned short) btinv(c, outp_img[iy][ib*nx + x], &nclamped);
+	}
+	return nclamped;
+}
+
+
+// convert scaled integers to physical reflectance
+//
+// nx -- number of columns
+// ny -- number of rows
+// buff1 -- input image (1d)
+// offset -- offset value for this band
+// scale -- scale factor for this band
+// inp_img -- reflectance output (2d) (preallocated output)
+// ib -- index of this band among the bands interleaved by line in inp_img
+//
+void
+int2ref(int nx, int ny, unsigned short *buff1, float offset, float scale, float **inp_img, int ib)
+{
+	BandConv c;
+
+	convert_setup(c, 0, false, false, offset, scale);
+	for(int iy=0; iy<ny; iy++) {
+		convert_row(c, &buff1[iy*nx], &inp_img[iy][ib*nx], nx);
+	}
+}
+
+// convert reflectance back to scaled integers
+//
+// nx -- number of columns
+// ny -- number of rows
+// outp_img -- reflectance image (2d)
+// offset -- offset value for this band
+// scale -- scale factor for this band
+// buff1 -- output integers (preallocated output)
+// ib -- index of this band among the bands interleaved by line in outp_img
+//
+// Returns the number of integers outside the valid range, which are
+// set to 65535.
+//
+int
+ref2int(int nx, int ny, float **outp_img, float offset, float scale, unsigned short *buff1, int ib)
+{
+	BandConv c;
+	int nclamped = 0;
+
+	convert_setup(c, 0, false, false, offset, scale);
+	for(int iy=0; iy<ny; iy++) {
+		nclamped += convert_row_back(c, &outp_img[iy][ib*nx], NULL, &buff1[iy*nx], nx);
+	}
+	return nclamped;
+}
@@ -0,0 +1,118 @@
+//
+// Raw cubes of resampled bands that can be memory-mapped
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "modisresam.h"
+
+static const char cubemagic[8] = "MODCUBE";
+
+// Create the cube file path for nband bands of ny rows of nx pixels,
+// followed by the latitude, and map it into memory. The file space is
+// allocated here, so that filling the mapping cannot run out of disk.
+// The bands, their names, scales and offsets, and the latitude are
+// filled in through c, and the cube is only marked valid by cube_close.
+//
+// Returns 0 on success, or a negative value on error.
+//
+int
+cube_create(Cube &c, const char *path, int nx, int ny, int nband, bool sorted)
+{
+	size_t planesize;
+	int i;
+
+	if(nband > CUBE_MAXBAND) {
+		printf("ERROR: Cannot write more than %d bands to cube %s\n", CUBE_MAXBAND, path);
+		return -1;
+	}
+	planesize = ((size_t)nx*ny*sizeof(unsigned short) + CUBE_ALIGN-1) / CUBE_ALIGN * CUBE_ALIGN;
+	c.size = CUBE_ALIGN + nband*planesize + ((size_t)nx*ny*sizeof(float) + CUBE_ALIGN-1) / CUBE_ALIGN * CUBE_ALIGN;
+	c.path = estrdup(path);
+	c.fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if(c.fd < 0) {
+		printf("ERROR: Cannot create cube %s: %s\n", path, strerror(errno));
+		free(c.path);
+		return -1;
+	}
+	if((errno = posix_fallocate(c.fd, 0, c.size)) != 0) {
+		printf("ERROR: Cannot allocate %ld bytes for cube %s: %s\n", (long)c.size, path, strerror(errno));
+		close(c.fd);
+		unlink(path);
+		free(c.path);
+		return -1;
+	}
+	c.base = (char *)mmap(NULL, c.size, PROT_READ|PROT_WRITE, MAP_SHARED, c.fd, 0);
+	if(c.base == MAP_FAILED) {
+		printf("ERROR: Cannot map cube %s: %s\n", path, strerror(errno));
+		close(c.fd);
+		unlink(path);
+		free(c.path);
+		return -1;
+	}
+
+	// the file is zero-filled, so the magic stays zero until cube_close
+	c.h = (CubeHeader *)c.base;
+	c.h->version = CUBE_VERSION;
+	c.h->nx = nx;
+	c.h->ny = ny;
+	c.h->nband = nband;
+	c.h->sorted = sorted;
+	c.h->planesize = planesize;
+	for(i = 0; i < nband; i++)
+		c.h->bands[i].dataoffset = CUBE_ALIGN + i*planesize;
+	c.h->latoffset = CUBE_ALIGN + nband*planesize;
+	return 0;
+}
+
+// Returns band b of cube c, stored row by row.
+unsigned short *
+cube_band(Cube &c, int b)
+{
+	return (unsigned short *)(c.base + c.h->bands[b].dataoffset);
+}
+
+// Returns the latitude of cube c, stored row by row.
+float *
+cube_latitude(Cube &c)
+{
+	return (float *)(c.base + c.h->latoffset);
+}
+
+// Copy rows y0 .. y0+nrows-1 of the nband bands in buf to the bands
+// b0 .. b0+nband-1 of cube c. Row y of band b starts at
+// buf[b*bandstride + (y-y0)*nx].
+void
+cube_putrows(Cube &c, int b0, int nband, const unsigned short *buf, size_t bandstride,
+	int y0, int nrows)
+{
+	size_t n = (size_t)nrows*c.h->nx;
+
+	for(int b = 0; b < nband; b++)
+		memcpy(&cube_band(c, b0+b)[(size_t)y0*c.h->nx], &buf[b*bandstride], n*sizeof(*buf));
+}
+
+// Unmap and close cube c. If ok, the cube is marked valid by writing
+// its magic number; otherwise the file is removed.
+//
+// Returns 0 on success, or a negative value on error.
+//
+int
+cube_close(Cube &c, bool ok)
+{
+	int status = 0;
+
+	if(ok)
+		memcpy(c.h->magic, cubemagic, sizeof(c.h->magic));
+	if(munmap(c.base, c.size) != 0)
+		status = -1;
+	if(close(c.fd) != 0)
+		status = -1;
+	if(ok && status < 0)
+		printf("ERROR: Cannot write cube %s: %s\n", c.path, strerror(errno));
+	if(!ok || status < 0)
+		unlink(c.path);
+	free(c.path);
+	return status;
+}
@@ -0,0 +1,236 @@
+//
+// Cache of the state derived from the latitude of a geolocation file
+//
+
+#include <limits.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "modisresam.h"
+
+// A cache file starts with a GeoCacheHeader in a block of GEOCACHE_ALIGN
+// bytes, followed by the sections of the resampling context, each
+// starting at a multiple of GEOCACHE_ALIGN bytes, so that the context
+// can use the mapped file without copying it.
+enum {
+	GEOCACHE_ALIGN = 4096,
+	GEOCACHE_VERSION = 1,
+	NSECTION = 7,
+};
+
+static const char geocachemagic[8] = "MODGEOC";
+
+struct GeoCacheHeader {
+	char	magic[8];
+	int32_t	version;
+	int32_t	rows, cols;
+	int32_t	latsort;	// sorted by the latitude, as with -d
+	int32_t	maxdisp;
+	int32_t	nseg, nuseg;	// number of segments and of inverse segments
+	int32_t	pad;
+	int64_t	size, mtime, mtimensec;	// of the geolocation file
+	int64_t	offset[NSECTION];	// offset of each section
+	int64_t	length[NSECTION];	// bytes in each section
+	char	geopath[1024];	// absolute path of the geolocation file
+};
+
+// Sections of a cache file.
+enum {
+	SEC_LAT,
+	SEC_SLAT,
+	SEC_LAM,
+	SEC_SEG,
+	SEC_OFF,
+	SEC_USEG,
+	SEC_UOFF,
+};
+
+// Set gc.key to the key of the geolocation file geopath, in a zeroed
+// block of GEOCACHE_ALIGN bytes that becomes the header of its cache
+// file, and gc.path to the path of the cache file in directory dir.
+// Returns a negative value if geopath cannot be found.
+static int
+geocache_key(GeoCache &gc, const char *dir, const char *geopath, bool latsort)
+{
+	char abspath[PATH_MAX], path[PATH_MAX + 32];
+	struct stat st;
+	uint64_t hash;
+	GeoCacheHeader *h;
+
+	if(realpath(geopath, abspath) == NULL || stat(abspath, &st) != 0)
+		return -1;
+	if(strlen(abspath) >= sizeof(h->geopath))
+		return -1;
+	h = (GeoCacheHeader *)calloc(1, GEOCACHE_ALIGN);
+	if(h == NULL)
+		return -1;
+	strcpy(h->geopath, abspath);
+	h->version = GEOCACHE_VERSION;
+	h->latsort = latsort;
+	h->size = st.st_size;
+	h->mtime = st.st_mtim.tv_sec;
+	h->mtimensec = st.st_mtim.tv_nsec;
+
+	// FNV-1a hash of the key
+	hash = 14695981039346656037ULL;
+	for(const char *s = h->geopath; *s != '\0'; s++)
+		hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+	const int64_t key[4] = {h->size, h->mtime, h->mtimensec, h->latsort};
+	for(size_t i = 0; i < sizeof(key); i++)
+		hash = (hash ^ ((const unsigned char*)key)[i]) * 1099511628211ULL;
+	snprintf(path, sizeof(path), "%s/%016llx.geo", dir, (unsigned long long)hash);
+	gc.key = h;
+	gc.path = estrdup(path);
+	return 0;
+}
+
+// Look up the geolocation file geopath, sorted by its latitude if latsort
+// is set, in the cache directory dir. On a hit, r is set up from the
+// mapped cache file, which is kept until geocache_close. On a miss, r is
+// left alone, and geocache_store can add r to the cache once it has been
+// set up with resample_init.
+//
+// Returns 1 on a hit and 0 on a miss.
+//
+int
+geocache_load(GeoCache &gc, const char *dir, const char *geopath, bool latsort, ResampleContext &r)
+{
+	const GeoCacheHeader *key, *h;
+	struct stat st;
+	int fd;
+
+	gc.key = NULL;
+	gc.path = NULL;
+	gc.base = NULL;
+	gc.size = 0;
+	if(geocache_key(gc, dir, geopath, latsort) < 0)
+		return 0;
+	key = gc.key;
+	fd = open(gc.path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(GeoCacheHeader)) {
+		close(fd);
+		return 0;
+	}
+	// the mapping is private, so the context can never write to the file
+	gc.size = st.st_size;
+	gc.base = mmap(NULL, gc.size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(gc.base == MAP_FAILED) {
+		gc.base = NULL;
+		return 0;
+	}
+
+	h = (GeoCacheHeader *)gc.base;
+	bool valid = memcmp(h->magic, geocachemagic, sizeof(h->magic)) == 0
+		&& h->version == key->version && h->latsort == key->latsort
+		&& h->size == key->size && h->mtime == key->mtime && h->mtimensec == key->mtimensec
+		&& strcmp(h->geopath, key->geopath) == 0;
+	for(int i = 0; valid && i < NSECTION; i++)
+		valid = h->offset[i] % GEOCACHE_ALIGN == 0 && h->offset[i] + h->length[i] <= (int64_t)gc.size;
+	valid = valid && h->length[SEC_LAT] == (int64_t)h->rows*h->cols*(int64_t)sizeof(float)
+		&& h->length[SEC_SLAT] == h->length[SEC_LAT] && h->length[SEC_LAM] == h->length[SEC_LAT]
+		&& h->length[SEC_SEG] == 3*(int64_t)h->nseg*(int64_t)sizeof(int)
+		&& h->length[SEC_USEG] == 3*(int64_t)h->nuseg*(int64_t)sizeof(int)
+		&& h->length[SEC_OFF] == (h->rows+1)*(int64_t)sizeof(int)
+		&& h->length[SEC_UOFF] == h->length[SEC_OFF];
+	if(!valid) {
+		munmap(gc.base, gc.size);
+		gc.base = NULL;
+		return 0;
+	}
+
+	char *b = (char *)gc.base;
+	r.lat = Mat(h->rows, h->cols, CV_32FC1, b + h->offset[SEC_LAT]);
+	r.slat = Mat(h->rows, h->cols, CV_32FC1, b + h->offset[SEC_SLAT]);
+	r.lam = Mat(h->rows, h->cols, CV_32FC1, b + h->offset[SEC_LAM]);
+	r.sind.rows = h->rows;
+	r.sind.cols = h->cols;
+	r.sind.maxdisp = h->maxdisp;
+	r.sind.seg = Mat(h->nseg, 3, CV_32SC1, b + h->offset[SEC_SEG]);
+	r.sind.off = Mat(h->rows+1, 1, CV_32SC1, b + h->offset[SEC_OFF]);
+	r.sind.useg = Mat(h->nuseg, 3, CV_32SC1, b + h->offset[SEC_USEG]);
+	r.sind.uoff = Mat(h->rows+1, 1, CV_32SC1, b + h->offset[SEC_UOFF]);
+	return 1;
+}
+
+// Write the sections of r to the cache file of gc after a miss. The file
+// is written under a temporary name and renamed, so that concurrent runs
+// only ever see complete cache files.
+//
+// Returns 0 on success, or a negative value on error.
+//
+int
+geocache_store(GeoCache &gc, const ResampleContext &r)
+{
+	GeoCacheHeader *h = gc.key;
+	const Mat *sec[NSECTION] = {
+		&r.lat, &r.slat, &r.lam, &r.sind.seg, &r.sind.off, &r.sind.useg, &r.sind.uoff,
+	};
+	char *tmp;
+	int fd, status = 0;
+
+	if(h == NULL)
+		return -1;
+	for(int i = 0; i < NSECTION; i++)
+		CV_Assert(sec[i]->isContinuous());
+
+	tmp = (char *)emalloc(strlen(gc.path) + 8);
+	sprintf(tmp, "%s.XXXXXX", gc.path);
+	fd = mkstemp(tmp);
+	if(fd < 0) {
+		printf("WARNING: Cannot create geolocation cache %s: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+
+	fchmod(fd, 0644);
+
+	// the header holds the key of the geolocation file before it was read
+	memcpy(h->magic, geocachemagic, sizeof(h->magic));
+	h->rows = r.sind.rows;
+	h->cols = r.sind.cols;
+	h->maxdisp = r.sind.maxdisp;
+	h->nseg = r.sind.seg.rows;
+	h->nuseg = r.sind.useg.rows;
+	int64_t off = GEOCACHE_ALIGN;
+	for(int i = 0; i < NSECTION; i++) {
+		h->offset[i] = off;
+		h->length[i] = (int64_t)sec[i]->total()*sec[i]->elemSize();
+		off += (h->length[i] + GEOCACHE_ALIGN-1) / GEOCACHE_ALIGN * GEOCACHE_ALIGN;
+	}
+	if(pwrite(fd, h, GEOCACHE_ALIGN, 0) != GEOCACHE_ALIGN)
+		status = -1;
+	for(int i = 0; status == 0 && i < NSECTION; i++) {
+		if(pwrite(fd, sec[i]->data, h->length[i], h->offset[i]) != h->length[i])
+			status = -1;
+	}
+	if(status == 0 && ftruncate(fd, off) != 0)
+		status = -1;
+	if(close(fd) != 0)
+		status = -1;
+	if(status == 0 && rename(tmp, gc.path) != 0)
+		status = -1;
+	if(status < 0) {
+		printf("WARNING: Cannot write geolocation cache %s: %s\n", gc.path, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+	return status;
+}
+
+// Release the mapping, the key and the path of gc.
+void
+geocache_close(GeoCache &gc)
+{
+	if(gc.base != NULL)
+		munmap(gc.base, gc.size);
+	free(gc.key);
+	free(gc.path);
+	gc.base = NULL;
+	gc.key = NULL;
+	gc.path = NULL;
+}
@@ -47,258 +47,663 @@ const char *bandNames[38] = {
 	"36",		/* 37. "EV_1KM_Emissive" */
 };
 
-// define array of wavelengths and assign correct values for emissive bands
-double lambda[38] = {
-	0,	// 0
-	0,	// 1
-	0,	// 2
-	0,	// 3
-	0,	// 4
-	0,	// 5
-	0,	// 6
-	0,	// 7
-	0,	// 8
-	0,	// 9
-	0,	// 10
-	0,	// 11
-	0,	// 12
-	0,	// 13
-	0,	// 14
-	0,	// 15
-	0,	// 16
-	0,	// 17
-	0,	// 18
-	0,	// 19
-	0,	// 20
-	0,	// 21
-	0.5*( 3.660 +  3.840)*1.0E-6, // 22. band 20
-	0.5*( 3.929 +  3.989)*1.0E-6, // 23. band 21
-	0.5*( 3.929 +  3.989)*1.0E-6, // 24. band 22
-	0.5*( 4.020 +  4.080)*1.0E-6, // 25. band 23
-	0.5*( 4.433 +  4.498)*1.0E-6, // 26. band 24
-	0.5*( 4.482 +  4.549)*1.0E-6, // 27. band 25
-	0.5*( 6.535 +  6.895)*1.0E-6, // 28. band 27 (sic)
-	0.5*( 7.175 +  7.475)*1.0E-6, // 29. band 28
-	0.5*( 8.400 +  8.700)*1.0E-6, // 30. band 29
-	0.5*( 9.580 +  9.880)*1.0E-6, // 31. band 30
-	0.5*(10.780 + 11.280)*1.0E-6, // 32. band 31
-	0.5*(11.770 + 12.270)*1.0E-6, // 33. band 32
-	0.5*(13.185 + 13.485)*1.0E-6, // 34. band 33
-	0.5*(13.485 + 13.785)*1.0E-6, // 35. band 34
-	0.5*(13.785 + 14.085)*1.0E-6, // 36. band 35
-	0.5*(14.085 + 14.385)*1.0E-6, // 37. band 36
+// Adds a block of rows of the selected bands of one data field to the
+// range of the conversion of each band. Bands are independent, so
+// each thread scans its own range of bands.
+class ConvertBody : public ParallelLoopBody {
+	const unsigned short *buffer; // scaled integers of all bands
+	int npix;               // number of pixels of each band in buffer
+	BandConv *conv;         // conversion of each band (output)
+	int *nmask;             // number of pixels with negative radiance per band (output)
+public:
+	ConvertBody(const unsigned short *_buffer, int _npix, BandConv *_conv, int *_nmask)
+		: buffer(_buffer), npix(_npix), conv(_conv), nmask(_nmask) {}
+
+	void operator()(const Range &r) const {
+		for(int i = r.start; i < r.end; i++) {
+			nmask[i] += convert_scan(conv[i], &buffer[i*npix], npix);
+		}
+	}
 };
 
-// k = Boltzmann gas constant (joules/Kelvin)
-const float k_Boltz = 1.3806488e-23;
-// h = Planck’s constant (joule * second)
-const float h_Planck = 6.62606957e-34;
-// c = speed of light in vacuum (m/s)
-const float c_light = 299792458.0;
-
-
-// Transfrom integers to radience and then to brightness temperature for emissive bands.
-//
-// is -- band number
-// nx -- number of columns
-// ny -- number of rows
-// buff1 -- input image (1d)
-// offset -- offset value for this band
-// scale -- scale factor for this band
-// maskNaN -- mask of pixels with negative radiance (1d) (preallocated output)
-// inp_img -- brightness temperature output (2d) (preallocated output)
-//
-void
-int2bt(int is, int nx, int ny, unsigned short *buff1, float offset, float scale,
-	int *maskNaN, float **inp_img)
-{
-	float r1, r2;
-	int nmask, ix, j;
-	
-	r1 = h_Planck*c_light/(k_Boltz*lambda[is]);
-	r2 = lambda[is];
-	r2 = 1.0e-6*(2.0*h_Planck*c_light*c_light)/(r2*r2*r2*r2*r2);
-
-	// find the minimum valid radiance > 0, mask all pixels with radiance <= 0
-	unsigned short jmin = 65535;
-	nmask = 0;
-	for(ix=0; ix<nx*ny; ix++) {
-		maskNaN[ix] = 0;      // originally assume data are physically valid
-
-		if(buff1[ix] <= offset) {
-			// found a pixel with negative radiance
-			maskNaN[ix] = 1;  // set the mask for unphysical data
-			nmask++;          // count such pixels
-			continue;
-		}
+// there are four data fields in MODIS HDF files that contain all bands this code can process
+// here are the data field names for the four data fields
+static char EV_250_Ref[] = "EV_250_Aggr1km_RefSB";
+static char EV_500_Ref[] = "EV_500_Aggr1km_RefSB";
+static char EV_1KM_Ref[] = "EV_1KM_RefSB";
+static char EV_1KM_Emi[] = "EV_1KM_Emissive";
+static char * dataFieldNames[4] = { EV_250_Ref, EV_500_Ref, EV_1KM_Ref, EV_1KM_Emi };
+
+// attribute names for the four data fields
+static char AttrRef[] = "reflectance";
+static char AttrRad[] = "radiance";
+static char * attrBaseNames[4] = { AttrRef, AttrRef, AttrRef, AttrRad };
+
+// indices in bandNames array of first band in a data field
+static int bandIndex[5] = { 0, 2, 7, 22, 38};
+
+// Options shared by all granules.
+struct Options {
+	bool	maskoverlap;
+	bool	sortoutput;
+	bool	fast;
+	bool	latsort;	// sort by the latitude of the granule, not sort.h
+	bool	gapmap;		// write a map of the pixels not resampled
+	bool	cube;		// write a raw cube of the resampled bands
+	bool	writehdf;	// write the resampled bands back to the HDF files
+	bool	hugepages;	// back the buffers with transparent huge pages
+	bool	sparse;		// resample only the pixels that change
+	int	nscans;		// number of scans read and written at a time
+	int	isBand[40];	// resample band i if isBand[i] != 0
+	FILE	*report;	// JSON report of each granule, or NULL
+	char	*cachedir;	// cache of the latitude and sorting indices, or NULL
+};
 
-		// update minimum physical radiance - used later as fill in value for unphysical values
-		if(buff1[ix]<jmin) {
-			jmin = buff1[ix];
-		}
-	}
-	// printf("nmask = %i nx*ny = %i jmin = %i\n", nmask, nx*ny, jmin);
+// Times in seconds and bytes of resampling one data field for the report.
+// The I/O thread reads and writes while the bands are resampled, and the
+// bands are resampled by several threads, so the times overlap.
+struct FieldReport {
+	int	nband;		// number of bands resampled
+	int	bands[40];	// index in bandNames of each band
+	BandTimes	times[40];	// time of each stage of each band
+	BandStats	stats[40];	// data-quality counts of each band
+	double	open, scan, read, write, wait, close, total;
+	long	nbytesread, nbyteswritten;
+};
 
-	// convert radiance to brightness temperature
-	nmask = 0;
-	double avebt = 0.0;
+// Times in seconds of resampling one granule for the report.
+struct GranuleReport {
+	double	open, latitude, writelatitude, close, total;
+	long	nbytesread, nbyteswritten;	// bytes of latitude
+	FieldReport	fields[4];
+};
 
-	for(ix=0; ix<nx*ny; ix++) {
-		j = buff1[ix];
+static const char *stageNames[NSTAGE] = {
+	"convert",
+	"sort",
+	"resample",
+	"unsort",
+	"convert_back",
+};
 
-		// if radiance less than smallest physical value, set it to fill in value
-		if(j<jmin) {
-			j = jmin;
-			nmask++;
-		}
+// Adds the time and bytes of reading and writing with pipe p to rep.
+static void
+reportpipe(FieldReport *rep, const ModisPipe &p)
+{
+	if(rep == NULL) return;
+	rep->read += p.readsec;
+	rep->write += p.writesec;
+	rep->wait += p.waitsec;
+	rep->nbytesread += p.nbytesread;
+	rep->nbyteswritten += p.nbyteswritten;
+}
 
-		// scale integers to physical radiance values
-		inp_img[0][ix] = scale*(j - offset);
+// Closes a data field that could not be resampled, without marking its
+// bands as resampled, and returns status.
+static int
+abandonfield(ModisField &field, int status)
+{
+	field.readwrite = 0;
+	modis_close(field);
+	return status;
+}
 
-		// calculate Brightness Temperature from Radiance
-		inp_img[0][ix] = r1/log(1.0 + r2/inp_img[0][ix]);
+// Resample the bands of data field iDataField of the MODIS file
+// hdffile using the resampling context rctx of its granule. If rep
+// is not NULL, the time spent in each stage is added to it. Unless
+// gaps is empty, the pixels that could not be resampled are set in it.
+// If cube is not NULL, the bands are also written to it, starting at
+// band cubeband. The buffers of the data field are allocated from arena,
+// which is reset first.
+// Returns a non-zero value on error.
+static int
+resamplefield(HdfFile &hdffile, ResampleContext &rctx, int iDataField, Options &opt,
+	FieldReport *rep, Mat &gaps, Cube *cube, int cubeband, Arena &arena)
+{
+	int is, status;
+	int ib, nb, nx, ny, iband;
+	int y, yout, nrows, k;
+	float Scale_arr[40], Offset_arr[40];
+	int bandList[40], nmask[40];
+	BandConv conv[40];
+	BandStats stats[40];
+
+	printf("========================================================================\n");
+	printf("Data_field number = %i   name = %s\n", iDataField, dataFieldNames[iDataField]);
+	printf("------------------------------------------------------------------------\n");
+	ib = bandIndex[iDataField];                              // index of first band of this data field in bandNames[] array
+	nb = bandIndex[iDataField+1] - bandIndex[iDataField];    // number of bands in this data field
 
-		// counter for average BT - just to check sanity of data
-		avebt +=  inp_img[0][ix];
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// make sure we have at least one band to resample in this data field
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	int nreadwrite = 0;
+	for(iband=0; iband<nb; iband++) {
+		if(opt.isBand[ib+iband]>0) nreadwrite++;
 	}
+	if(nreadwrite==0) return 0;   // if no bands to resample in this data field, return
+	double t0 = nowsec(), t1;
+	arena_reset(arena);
 
-	printf("Number of pixels with negative radiances on input = %i\n", nmask);
-	// printf("Average Brightness Temperature = %e \n", avebt/(nx*ny));
-}
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// open the data field for reading and writing a block of scans at a time
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	ModisField field;
+	status = modis_open(field, hdffile, nb, &(Scale_arr[ib]), &(Offset_arr[ib]), &(opt.isBand[ib]),
+	                    dataFieldNames[iDataField], attrBaseNames[iDataField], opt.writehdf);
+	if(rep) rep->open = nowsec() - t0;
+	if(status<0) {
+		printf("ERROR: Cannot read data field %s\n", dataFieldNames[iDataField]);
+		return abandonfield(field, 10*status);
+	}
+	nx = field.nx;
+	ny = field.ny;
+	if(rctx.lat.rows != ny || rctx.lat.cols != nx){
+		printf("ERROR: latitude image dimensions agree with band image\n");
+		return abandonfield(field, 2);
+	}
 
+	// all bands of this data field are read and written a block
+	// of scans at a time by a separate I/O thread, so that reading
+	// and writing overlap with resampling
+	int blockrows = MIN(opt.nscans*SWATH_SIZE, ny);
+	ModisPipe pipe;
+	unsigned short *buffer1, *buffer2 = NULL;
 
-// convert output brightness temperature back to radiance and then back to integer
-//
-// is -- band number
-// nx -- number of columns
-// ny -- number of rows
-// outp_img -- brightness temperature image (2d)
-// offset -- offset value for this band
-// scale -- scale factor for this band
-// maskNaN -- mask of pixels with negative radiance (1d)
-// buff1 -- output integers (preallocated output)
-//
-void
-bt2int(int is, int nx, int ny, float **outp_img, float offset, float scale, int *maskNaN, unsigned short *buff1)
-{
-	float r1, r2;
-	int ix, j;
-	float z;
-
-	r1 = h_Planck*c_light/(k_Boltz*lambda[is]);
-	r2 = lambda[is];
-	r2 = 1.0e-6*(2.0*h_Planck*c_light*c_light)/(r2*r2*r2*r2*r2);
-	
-	for(ix=0; ix<nx*ny; ix++) {
-		// preserve the original data
-		// in case of unphysical negative radiance in original data (produces NaN in Brightness Temperature)
-		if(maskNaN[ix] == 1) continue;
-
-		// get the radiance from brightness temperature
-		z = r2/(exp(r1/outp_img[0][ix]) - 1.0);
-
-		// scale the radiance back to integer
-		j = (int) round(z/scale + offset);
-
-		// check that integer is within valid bounds
-		if((j<0) || (j>65535)) {
-			printf("Value outside range %i\n", j);
-			j = 65535;
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// list the bands to resample in the current data field
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	int iBandIndx = 0;
+	for(iband=0; iband<nb; iband++) {
+
+		// index of the current band in bandNames[] array is a sum of
+		//    index of first band of this data field in bandNames[] array and
+		//    index of band within the current data field
+		is = ib + iband;
+
+		// printf("iband = %i isband = %i\n", iband, isBand[is]);
+		if(opt.isBand[is]==0) continue; // if no parameters for this band, then pass
+
+		bandList[iBandIndx] = is;
+		if(rep) rep->bands[iBandIndx] = is;
+		if(cube) {
+			strncpy(cube->h->bands[cubeband+iBandIndx].name, bandNames[is], sizeof(cube->h->bands[0].name)-1);
+			cube->h->bands[cubeband+iBandIndx].scale = Scale_arr[is];
+			cube->h->bands[cubeband+iBandIndx].offset = Offset_arr[is];
+		}
+		iBandIndx++;                         // increment the index of next band data to resample
+	} // for iband
+	if(rep) rep->nband = nreadwrite;
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// set up the conversion of all the bands to physical values;
+	// the conversion of emissive bands depends on the range of
+	// their integers, which takes a first pass over the data field
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	for(iBandIndx=0; iBandIndx<nreadwrite; iBandIndx++) {
+		is = bandList[iBandIndx];
+		convert_setup(conv[iBandIndx], is, iDataField==3, opt.fast, Offset_arr[is], Scale_arr[is]);
+		nmask[iBandIndx] = 0;
+	}
+	if(iDataField==3) {
+		status = pipe_start(pipe, field, blockrows, false, &arena);
+		if(status<0) return abandonfield(field, 10*status);
+		for(k=0; k<pipe.nblock && (buffer1 = pipe_read(pipe, k)) != NULL; k++) {
+			nrows = MIN(blockrows, ny-k*blockrows);
+			t1 = nowsec();
+			parallel_for_(Range(0, nreadwrite), ConvertBody(buffer1, nrows*nx, conv, nmask));
+			if(rep) rep->scan += nowsec() - t1;
+			pipe_release(pipe);
+		}
+		status = pipe_finish(pipe);
+		reportpipe(rep, pipe);
+		if(status<0) {
+			printf("ERROR: Cannot read data field %s\n", dataFieldNames[iDataField]);
+			return abandonfield(field, 10*status);
+		}
+		arena_reset(arena);	// the blocks of the scan are no longer used
+	}
+	t1 = nowsec();
+	for(iBandIndx=0; iBandIndx<nreadwrite; iBandIndx++) {
+		convert_tables(conv[iBandIndx]);
+	}
+	if(rep) rep->scan += nowsec() - t1;
+
+	for(iBandIndx=0; iBandIndx<nreadwrite; iBandIndx++) {
+		is = bandList[iBandIndx];
+		printf("Band = %i  MODIS_band_number = %s   scale = %e  offset = %e\n", is-ib, bandNames[is], Scale_arr[is], Offset_arr[is]);
+		memset(&stats[iBandIndx], 0, sizeof(stats[iBandIndx]));
+		stats[iBandIndx].nnegative = nmask[iBandIndx];
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// resample all bands of the current data field at once, a swath
+	// at a time, converting them to physical values and back on the
+	// fly; each block of resampled scans is written back to the hdf
+	// file as soon as it is finished, which is always after the
+	// scans it was resampled from have been read. Without the hdf
+	// file, the swaths are resampled straight into the cube.
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	SwathStream stream;
+	if(stream_init(stream, rctx, nreadwrite, conv, opt.maskoverlap, opt.sortoutput,
+		opt.sparse ? &rctx.touch : NULL, 0, &arena) < 0) {
+		printf("ERROR: Sorting moves rows by %d, more than a swath\n", rctx.sind.maxdisp);
+		return abandonfield(field, 2);
+	}
+	if(rep) stream.times = rep->times;
+	stream.gaps = gaps;
+	status = pipe_start(pipe, field, blockrows, opt.writehdf, &arena);
+	if(status<0) return abandonfield(field, 10*status);
+	pipe.changed = &stream.changed;	// only write back the rows that resampling changed
+	for(int kin=0; kin<pipe.nblock && (buffer1 = pipe_read(pipe, kin)) != NULL; kin++) {
+		nrows = MIN(blockrows, ny-kin*blockrows);
+		// the bands of a block are stored one after another
+		for(y=0; y<nrows; y+=SWATH_SIZE) {
+			stream_push(stream, &buffer1[y*nx], (size_t)nrows*nx);
+			while((k = stream_ready(stream)) >= 0) {
+				if(!opt.writehdf) {
+					stream_pull(stream, &cube_band(*cube, cubeband)[(size_t)k*SWATH_SIZE*nx],
+						cube->h->planesize/sizeof(unsigned short));
+					continue;
+				}
+				int kout = k*SWATH_SIZE/blockrows;
+				yout = kout*blockrows;
+				int noutrows = MIN(blockrows, ny-yout);
+				if(k*SWATH_SIZE == yout && (buffer2 = pipe_outbuf(pipe, kout)) == NULL)
+					goto pipedone;	// write error
+				stream_pull(stream, &buffer2[(k*SWATH_SIZE - yout)*nx], (size_t)noutrows*nx);
+				if(cube) {
+					cube_putrows(*cube, cubeband, nreadwrite, &buffer2[(k*SWATH_SIZE - yout)*nx],
+						(size_t)noutrows*nx, k*SWATH_SIZE, SWATH_SIZE);
+				}
+				if((k+1)*SWATH_SIZE == yout+noutrows)
+					pipe_filled(pipe);
+			}
 		}
+		pipe_release(pipe);
+	}
+pipedone:
+	status = pipe_finish(pipe);
+	reportpipe(rep, pipe);
+	if(status<0) {
+		printf("ERROR: Failed to read or write data field %s\n", dataFieldNames[iDataField]);
+		return abandonfield(field, 10*status);
+	}
+	stream_finish(stream);
+	stream_stats(stream, 0, stream.nswath, stats);
+	for(iBandIndx=0; iBandIndx<nreadwrite; iBandIndx++) {
+		const BandStats &st = stats[iBandIndx];
+		printf("MODIS_band_number = %s   not resampled = %i  clamped = %i  negative radiances = %i  masked overlaps = %i\n",
+			bandNames[bandList[iBandIndx]], st.nnan, st.nclamped, st.nnegative, st.noverlap);
+		if(rep) rep->stats[iBandIndx] = st;
+	}
+	printf("Resampling done\n");
+	printf("------------------------------------------------------------------------\n");
 
-		// copy value to output buffer
-		buff1[ix] = (unsigned short) j;
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// set resampling attribute and close the data field
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	t1 = nowsec();
+	status = modis_close(field);
+	if(rep) {
+		rep->close = nowsec() - t1;
+		rep->total = nowsec() - t0;
 	}
+	if(status<0) {
+		printf("ERROR: Failed to write data\n");
+		return 10*status;
+	}
+	return 0;
 }
 
+static Mutex reportlock;
 
-// convert scaled integers to physical reflectance
-//
-// nx -- number of columns
-// ny -- number of rows
-// buff1 -- input image (1d)
-// offset -- offset value for this band
-// scale -- scale factor for this band
-// inp_img -- reflectance output (2d) (preallocated output)
-//
-void
-int2ref(int nx, int ny, unsigned short *buff1, float offset, float scale, float **inp_img)
+// Print s to f as a JSON string.
+static void
+jsonstring(FILE *f, const char *s)
 {
-	int ix;
-	
-	for(ix=0; ix<nx*ny; ix++) {
-		inp_img[0][ix] = scale*( ((float) (buff1[ix])) - offset);
+	fputc('"', f);
+	for(; *s != '\0'; s++) {
+		if(*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
 	}
+	fputc('"', f);
 }
 
-// convert reflectance back to scaled integers
-//
-// nx -- number of columns
-// ny -- number of rows
-// outp_img -- reflectance image (2d)
-// offset -- offset value for this band
-// scale -- scale factor for this band
-// buff1 -- output integers (preallocated output)
-//
-void
-ref2int(int nx, int ny, float **outp_img, float offset, float scale, unsigned short *buff1)
+// Write the report rep of granule geopath, hdfpath that ended with
+// status to f as a JSON object on one line.
+static void
+writereport(FILE *f, const char *geopath, const char *hdfpath, int status,
+	const GranuleReport &rep, const Options &opt)
 {
-	int ix, j;
-	
-	for(ix=0; ix<nx*ny; ix++) {
-		// scale the reflectance back to integer
-		j = (int) round(outp_img[0][ix]/scale + offset);
-
-		// check that integer is within valid bounds
-		if((j<0) || (j>65535)) {
-			printf("Value outside range %i\n", j);
-			j = 65535;
-		}
+	AutoLock lock(reportlock);
+	long nbytesread = rep.nbytesread, nbyteswritten = rep.nbyteswritten;
 
-		// copy value to output buffer
-		buff1[ix] = (unsigned short) j;
+	for(int i = 0; i < 4; i++) {
+		nbytesread += rep.fields[i].nbytesread;
+		nbyteswritten += rep.fields[i].nbyteswritten;
+	}
+	fprintf(f, "{\"geo\": ");
+	jsonstring(f, geopath);
+	fprintf(f, ", \"hdf\": ");
+	jsonstring(f, hdfpath);
+	fprintf(f, ", \"status\": %d, \"threads\": %d, \"nscans\": %d", status, getNumThreads(), opt.nscans);
+	fprintf(f, ", \"open\": %.6f, \"latitude\": %.6f, \"write_latitude\": %.6f",
+		rep.open, rep.latitude, rep.writelatitude);
+	fprintf(f, ", \"close\": %.6f, \"total\": %.6f", rep.close, rep.total);
+	fprintf(f, ", \"bytes_read\": %ld, \"bytes_written\": %ld, \"peak_rss_kb\": %ld",
+		nbytesread, nbyteswritten, peakrss());
+	fprintf(f, ", \"fields\": [");
+	const char *sep = "";
+	for(int i = 0; i < 4; i++) {
+		const FieldReport &fr = rep.fields[i];
+		if(fr.nband == 0) continue;
+		fprintf(f, "%s{\"name\": \"%s\"", sep, dataFieldNames[i]);
+		fprintf(f, ", \"open\": %.6f, \"scan\": %.6f, \"read\": %.6f, \"write\": %.6f",
+			fr.open, fr.scan, fr.read, fr.write);
+		fprintf(f, ", \"wait\": %.6f, \"close\": %.6f, \"total\": %.6f", fr.wait, fr.close, fr.total);
+		fprintf(f, ", \"bytes_read\": %ld, \"bytes_written\": %ld", fr.nbytesread, fr.nbyteswritten);
+		fprintf(f, ", \"bands\": [");
+		for(int b = 0; b < fr.nband; b++) {
+			fprintf(f, "%s{\"band\": \"%s\"", b > 0 ? ", " : "", bandNames[fr.bands[b]]);
+			for(int j = 0; j < NSTAGE; j++)
+				fprintf(f, ", \"%s\": %.6f", stageNames[j], fr.times[b].sec[j]);
+			const BandStats &st = fr.stats[b];
+			fprintf(f, ", \"not_resampled\": %d, \"clamped\": %d", st.nnan, st.nclamped);
+			fprintf(f, ", \"negative_radiances\": %d, \"masked_overlaps\": %d", st.nnegative, st.noverlap);
+			fprintf(f, "}");
+		}
+		fprintf(f, "]}");
+		sep = ", ";
 	}
+	fprintf(f, "]}\n");
+	fflush(f);
 }
 
+// Write the gap map gaps of a granule nx pixels wide to hdfpath.gaps.pbm
+// as a PBM image, where the pixels not resampled in any band are black.
+// Returns a non-zero value on error.
+static int
+writegapmap(const char *hdfpath, const Mat &gaps, int nx)
+{
+	char path[1024];
+	FILE *f;
+	int status = 0;
+
+	snprintf(path, sizeof(path), "%s.gaps.pbm", hdfpath);
+	f = fopen(path, "wb");
+	if(f == NULL) {
+		printf("ERROR: Cannot create gap map %s\n", path);
+		return 2;
+	}
+	fprintf(f, "P4\n%d %d\n", nx, gaps.rows);
+	if(fwrite(gaps.data, gaps.cols, gaps.rows, f) != (size_t)gaps.rows)
+		status = 2;
+	if(fclose(f) != 0)
+		status = 2;
+	if(status != 0)
+		printf("ERROR: Cannot write gap map %s\n", path);
+	return status;
+}
 
-void
-sortlatitude(const char *geopath)
+// Resample the bands of the MODIS file hdfpath with geolocation
+// file geopath, adding the time spent in each stage to rep. The
+// buffers of each data field are allocated from arena.
+// Returns a non-zero value on error.
+static int
+resamplefiles(char *geopath, char *hdfpath, Options &opt, GranuleReport &rep, Arena &arena)
 {
-	Mat sind;
-	
+	int iDataField, status;
+	double t0 = nowsec(), t1;
+
+	// look up the latitude and sorting indices in the cache; the
+	// geolocation file is then only opened to write the sorted latitude
+	ResampleContext rctx;
+	GeoCache gc = {NULL, NULL, NULL, 0};
+	int cached = 0;
+	if(opt.cachedir != NULL)
+		cached = geocache_load(gc, opt.cachedir, geopath, opt.latsort, rctx);
+	bool opengeo = !cached || (opt.sortoutput && opt.writehdf);
+
+	// open each file once for all the data records read and written
+	HdfFile geofile, hdffile;
+	if(opengeo) {
+		status = hdf_open(geofile, geopath, opt.sortoutput && opt.writehdf);
+		if(status<0) {
+			printf("ERROR: Cannot open %s\n", geopath);
+			geocache_close(gc);
+			return 10*status;
+		}
+	}
+	status = hdf_open(hdffile, hdfpath, opt.writehdf);
+	if(status<0) {
+		printf("ERROR: Cannot open %s\n", hdfpath);
+		if(opengeo) hdf_close(geofile);
+		geocache_close(gc);
+		return 10*status;
+	}
+	rep.open = nowsec() - t0;
+
 	// read latitude
+	t1 = nowsec();
 	int latrows, latcols;
-	float *_lat;
-	if(readlatitude(&_lat, &latcols, &latrows, geopath) < 0) {
-		printf("ERROR: Cannot read data Latitude data\n");
-		exit(2);
+	float *lat = NULL;
+	Mat gaps;
+	Cube cube, *cubep = NULL;
+	if(cached) {
+		printf("Latitude and sorting indices from %s\n", gc.path);
+		latrows = rctx.lat.rows;
+		latcols = rctx.lat.cols;
+		status = 0;
+	} else {
+		status = readlatitude(&lat, &latcols, &latrows, geofile);
+		if(status<0) {
+			printf("ERROR: Cannot read data Latitude data\n");
+			status *= 10;
+		} else {
+			// sorting indices and sorted latitude are shared by all bands
+			resample_init(rctx, Mat(latrows, latcols, CV_32FC1, lat), opt.latsort);
+			rep.nbytesread = (long)latrows*latcols*sizeof(float);
+			// writing the sorted latitude changes the geolocation
+			// file, which would never match the cache again
+			if(opt.cachedir != NULL && !(opt.sortoutput && opt.writehdf))
+				geocache_store(gc, rctx);
+			status = 0;
+		}
+	}
+	if(status==0 && opt.gapmap)
+		gaps = Mat::zeros(latrows, (latcols+7)/8, CV_8UC1);
+	if(status==0 && opt.sparse) {
+		if(touch_init(rctx.touch, rctx, opt.maskoverlap) < 0) {
+			printf("ERROR: Sorting moves pixels too far to resample only the changed ones\n");
+			status = 2;
+		} else {
+			printf("Resampling changes %d of %d pixels of each band\n",
+				rctx.touch.off.at<int>(latrows, 0), latrows*latcols);
+		}
+	}
+	rep.latitude = nowsec() - t1;
+
+	// the cube holds all the resampled bands in the order of bandNames
+	if(status==0 && opt.cube) {
+		char path[1024];
+		int nband = 0;
+		for(int i=0; i<38; i++) {
+			if(opt.isBand[i]>0) nband++;
+		}
+		snprintf(path, sizeof(path), "%s.cube", hdfpath);
+		if(cube_create(cube, path, latcols, latrows, nband, opt.sortoutput) < 0)
+			status = 2;
+		else
+			cubep = &cube;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// loop over all 4 data fields
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	int cubeband = 0;
+	for(iDataField=0; status==0 && iDataField<4; iDataField++) {
+		status = resamplefield(hdffile, rctx, iDataField, opt,
+			opt.report ? &rep.fields[iDataField] : NULL, gaps, cubep, cubeband, arena);
+		for(int i=bandIndex[iDataField]; i<bandIndex[iDataField+1]; i++) {
+			if(opt.isBand[i]>0) cubeband++;
+		}
+	}
+	if(status==0 && opt.gapmap)
+		status = writegapmap(hdfpath, gaps, latcols);
+	if(cubep != NULL) {
+		if(status==0) {
+			const Mat &outlat = opt.sortoutput ? rctx.slat : rctx.lat;
+			memcpy(cube_latitude(cube), outlat.data, (size_t)latrows*latcols*sizeof(float));
+		}
+		if(cube_close(cube, status==0) < 0 && status==0)
+			status = 2;
+	}
+
+	// the sorted latitude was already computed for resampling
+	t1 = nowsec();
+	if(status==0 && opt.sortoutput && opt.writehdf) {
+		if(writelatitude(rctx.slat, geofile) < 0) {
+			printf("ERROR: Cannot wite Latitude data\n");
+			status = 2;
+		} else {
+			rep.nbyteswritten = (long)latrows*latcols*sizeof(float);
+		}
 	}
+	rep.writelatitude = nowsec() - t1;
 
-	Mat lat(latrows, latcols, CV_32FC1, _lat);
-	getsortingind(sind, latrows/SWATH_SIZE);
-	Mat slat = resample_sort(sind, lat);
-	if(writelatitude(slat, geopath) < 0){
+	t1 = nowsec();
+	if(hdf_close(hdffile)<0 && status==0) {
+		printf("ERROR: Failed to write data\n");
+		status = -10;
+	}
+	if(opengeo && hdf_close(geofile)<0 && status==0) {
 		printf("ERROR: Cannot wite Latitude data\n");
-		exit(2);
+		status = -10;
 	}
+	rep.close = nowsec() - t1;
+	free(lat);
+	geocache_close(gc);
+	return status;
 }
 
+// Resample the bands of the MODIS file hdfpath with geolocation
+// file geopath, and write its report if opt.report is set.
+// Returns a non-zero value on error.
+static int
+resamplegranule(char *geopath, char *hdfpath, Options &opt)
+{
+	GranuleReport rep;
+	double t0 = nowsec();
+	int status;
+
+	// each thread keeps its arena for all the granules it resamples,
+	// so the buffers of a batch are mapped once per thread
+	static thread_local Arena arena;
+	static thread_local bool arenainit;
+	if(!arenainit) {
+		arena_init(arena, opt.hugepages);
+		arenainit = true;
+	}
+
+	memset(&rep, 0, sizeof rep);
+	status = resamplefiles(geopath, hdfpath, opt, rep, arena);
+	rep.total = nowsec() - t0;
+	if(opt.report)
+		writereport(opt.report, geopath, hdfpath, status, rep, opt);
+	return status;
+}
+
+// Resamples a list of granules. Each granule is a separate stripe,
+// so that idle threads pick up the remaining granules and granules
+// that take longer, such as day granules with reflective bands, do
+// not hold up the others.
+class GranuleBody : public ParallelLoopBody {
+	char **geopaths, **hdfpaths;
+	Options &opt;
+	int *status;		// status of each granule (output)
+public:
+	GranuleBody(char **_geopaths, char **_hdfpaths, Options &_opt, int *_status)
+		: geopaths(_geopaths), hdfpaths(_hdfpaths), opt(_opt), status(_status) {}
+
+	void operator()(const Range &r) const {
+		for(int i = r.start; i < r.end; i++) {
+			printf("Granule %i: %s %s\n", i, hdfpaths[i], geopaths[i]);
+			status[i] = resamplegranule(geopaths[i], hdfpaths[i], opt);
+			printf("Granule %i: %s\n", i, status[i]==0 ? "done" : "FAILED");
+		}
+	}
+};
+
 char *progname;
 
+enum {
+	NSCANS = 16,	// default number of scans read and written at a time
+};
+
 static void
 usage()
 {
 	printf("usage: %s [flags] MOD03_hdf_file MODIS_hdf_file bands.txt\n", progname);
+	printf("       %s [flags] -l granules.txt bands.txt\n", progname);
 	printf("\n");
 	printf("Resample bands from 1KM MODIS file MODIS_hdf_file with geolocation file\n");
 	printf("MOD03_hdf_file. The bands to be resampled are specified in bands.txt.\n");
 	printf("The output is written back into the input file, and a \"Resampling\" attribute\n");
-	printf("is added to each HDF layer that was modified.\n");
+	printf("is added to each HDF layer that was modified. The first line of the log\n");
+	printf("repeats the flags that were set, in the order below, always with -j, and\n");
+	printf("the files.\n");
 	printf("\n");
 	printf("	-m	mask out overlapping regions before resampling, simulating\n");
 	printf("		deletion zones similar to VIIRS\n");
 	printf("	-s	the latitude in MOD03_hdf_file and the resampled bands\n");
 	printf("		in MODIS_hdf_file are saved in sorted order\n");
+	printf("	-f	use fast approximations of log and exp to convert emissive\n");
+	printf("		bands; the output may differ from the exact conversion by 1\n");
+	printf("	-d	sort each granule by its own latitude instead of the\n");
+	printf("		built-in sorting indices; columns that cannot be sorted\n");
+	printf("		within a swath keep the built-in order\n");
+	printf("	-j n	use n threads for conversion and resampling (default 1);\n");
+	printf("		the output does not depend on n\n");
+	printf("	-b n	read and write n scans of %d rows at a time (default %d);\n", SWATH_SIZE, NSCANS);
+	printf("		the output does not depend on n\n");
+	printf("	-l granules.txt\n");
+	printf("		resample the granules listed in granules.txt, one\n");
+	printf("		MOD03_hdf_file and MODIS_hdf_file pair per line; with -j n\n");
+	printf("		and at least n granules, several granules are resampled\n");
+	printf("		at the same time and their log lines are interleaved;\n");
+	printf("		with fewer, they are resampled one after another\n");
+	printf("	-t report.json\n");
+	printf("		write the time spent opening, reading, converting, sorting,\n");
+	printf("		resampling, unsorting, converting back, writing and closing\n");
+	printf("		each data field and band, the bytes read and written, the\n");
+	printf("		peak memory use, and the counts of the band summaries in\n");
+	printf("		the log to report.json, one JSON object per granule and\n");
+	printf("		line; reading and writing overlap with resampling, and the\n");
+	printf("		times of the bands add up the time of all threads\n");
+	printf("	-c	also write the resampled bands and the latitude, in the\n");
+	printf("		row order of the output, to MODIS_hdf_file.cube, a raw\n");
+	printf("		cube that can be memory-mapped; see modisresam.h\n");
+	printf("	-n	do not write the resampled bands and the sorted latitude\n");
+	printf("		back into the HDF files; needs -c\n");
+	printf("	-k dir	keep the latitude, sorted latitude and sorting indices of\n");
+	printf("		each MOD03_hdf_file in dir, keyed by its path, size and\n");
+	printf("		modification time, and reuse them instead of reading and\n");
+	printf("		sorting the latitude again; nothing is kept when -s\n");
+	printf("		rewrites MOD03_hdf_file\n");
+	printf("	-g	write a bitmap of the pixels that could not be resampled\n");
+	printf("		in any band to MODIS_hdf_file.gaps.pbm\n");
+	printf("	-p	only convert and resample the pixels that resampling\n");
+	printf("		changes, found once per granule from the sorting indices\n");
+	printf("		and the overlaps, and copy the others; the output is the\n");
+	printf("		same; cannot be used with -s\n");
+	printf("	-H	back the read, write and resampling buffers with\n");
+	printf("		transparent huge pages where the kernel allows it\n");
 	exit(2);
 }
 
@@ -311,38 +716,27 @@ int
 main(int argc, char** argv)
 {
 	char *flag;
-
-	// there are four data fields in MODIS HDF files that contain all bands this code can process
-	// here are the data field names for the four data fields
-	char EV_250_Ref[] = "EV_250_Aggr1km_RefSB";
-	char EV_500_Ref[] = "EV_500_Aggr1km_RefSB";
-	char EV_1KM_Ref[] = "EV_1KM_RefSB";
-	char EV_1KM_Emi[] = "EV_1KM_Emissive";
-	char * dataFieldNames[4] = { EV_250_Ref, EV_500_Ref, EV_1KM_Ref, EV_1KM_Emi };
-
-	// attribute names for the four data fields
-	char AttrRef[] = "reflectance";
-	char AttrRad[] = "radiance";
-	char * attrBaseNames[4] = { AttrRef, AttrRef, AttrRef, AttrRad };
-
-	// indices in bandNames array of first band in a data field
-	int bandIndex[5] = { 0, 2, 7, 22, 38};
-
-	unsigned short *buffer1 = NULL, *buff1;
-	float **inp_img  = NULL;
-	int    *maskNaN  = NULL;
-
-	int is, status, i, j;
-
-	int ib, nb, nx, ny, iband,  iDataField;
-	int isBand[40];
-	float Scale_arr[40], Offset_arr[40];
+	int is, i, j;
+	Options opt;
 
 
 	// parse arguments
 	GETARG(progname);
-	bool maskoverlap = false;
-	bool sortoutput = false;
+	opt.maskoverlap = false;
+	opt.sortoutput = false;
+	opt.fast = false;
+	opt.latsort = false;
+	opt.gapmap = false;
+	opt.cube = false;
+	opt.writehdf = true;
+	opt.hugepages = false;
+	opt.sparse = false;
+	opt.report = NULL;
+	opt.cachedir = NULL;
+	opt.nscans = NSCANS;
+	int nthreads = 1;
+	char *listpath = NULL;
+	char *reportpath = NULL;
 	while(argc > 0 && strlen(argv[0]) == 2 && argv[0][0] == '-') {
 		GETARG(flag);
 
@@ -353,23 +747,96 @@ main(int argc, char** argv)
 		case '-':
 			goto argdone;
 		case 'm':
-			maskoverlap = true;
+			opt.maskoverlap = true;
 			break;
 		case 's':
-			sortoutput = true;
+			opt.sortoutput = true;
+			break;
+		case 'f':
+			opt.fast = true;
+			break;
+		case 'd':
+			opt.latsort = true;
+			break;
+		case 'g':
+			opt.gapmap = true;
+			break;
+		case 'c':
+			opt.cube = true;
+			break;
+		case 'n':
+			opt.writehdf = false;
+			break;
+		case 'H':
+			opt.hugepages = true;
+			break;
+		case 'p':
+			opt.sparse = true;
+			break;
+		case 'j':
+			if(argc < 1)
+				usage();
+			GETARG(flag);
+			nthreads = atoi(flag);
+			if(nthreads < 1)
+				usage();
+			break;
+		case 'b':
+			if(argc < 1)
+				usage();
+			GETARG(flag);
+			opt.nscans = atoi(flag);
+			if(opt.nscans < 1)
+				usage();
+			break;
+		case 'l':
+			if(argc < 1)
+				usage();
+			GETARG(listpath);
+			break;
+		case 't':
+			if(argc < 1)
+				usage();
+			GETARG(reportpath);
+			break;
+		case 'k':
+			if(argc < 1)
+				usage();
+			GETARG(opt.cachedir);
 			break;
 		}
 	}
 argdone:
-	if(argc != 3)
+	if(argc != (listpath != NULL ? 1 : 3) || (!opt.writehdf && !opt.cube) || (opt.sparse && opt.sortoutput))
 		usage();
-	char *geopath = argv[0];
-	char *hdfpath = argv[1];
-	char *parampath = argv[2];
-	printf("modisresam %s%s%s %s %s\n",
-		maskoverlap ? "-m " : "",
-		sortoutput ? "-s " : "",
-		hdfpath, geopath, parampath);
+	char *geopath = NULL;
+	char *hdfpath = NULL;
+	char *parampath = argv[argc-1];
+	if(listpath == NULL) {
+		geopath = argv[0];
+		hdfpath = argv[1];
+	}
+
+	// echo the flags that were set, in the order of usage, and the
+	// number of threads, so that the log shows how it was made
+	printf("modisresam");
+	if(opt.maskoverlap) printf(" -m");
+	if(opt.sortoutput) printf(" -s");
+	if(opt.fast) printf(" -f");
+	if(opt.latsort) printf(" -d");
+	printf(" -j %d", nthreads);
+	if(opt.nscans != NSCANS) printf(" -b %d", opt.nscans);
+	if(listpath != NULL) printf(" -l %s", listpath);
+	if(reportpath != NULL) printf(" -t %s", reportpath);
+	if(opt.cube) printf(" -c");
+	if(!opt.writehdf) printf(" -n");
+	if(opt.cachedir != NULL) printf(" -k %s", opt.cachedir);
+	if(opt.gapmap) printf(" -g");
+	if(opt.sparse) printf(" -p");
+	if(opt.hugepages) printf(" -H");
+	if(listpath == NULL) printf(" %s %s", geopath, hdfpath);
+	printf(" %s\n", parampath);
+	setNumThreads(nthreads);
 
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	// read input parameters from parameter file
@@ -386,7 +853,7 @@ argdone:
 	// read parameters
 	char tmpbandname[128];
 	for(i=0; i<40; i++) {
-		isBand[i] = 0;    // initially, set all band parameters as "absent"
+		opt.isBand[i] = 0;    // initially, set all band parameters as "absent"
 	}
 	for(i=0; i<40; i++) {                    // read at most 40 lines in parameter file
 
@@ -406,7 +873,7 @@ argdone:
 		if(is==-1){
 			break; // if band name not valid, break
 		}
-		isBand[is]=1;
+		opt.isBand[is]=1;
 
 		// echo read destriping parameters
 		printf("will resample band %s\n", bandNames[is]);
@@ -417,132 +884,78 @@ argdone:
 	// done reading parameters
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	// read latitude
-	int latrows, latcols;
-	float *lat;
-	status = readlatitude(&lat, &latcols, &latrows, geopath);
-	if(status<0) {
-		printf("ERROR: Cannot read data Latitude data\n");
-		return 10*status;
+	if(reportpath != NULL) {
+		opt.report = fopen(reportpath, "w");
+		if(opt.report == NULL) {
+			printf("ERROR: Cannot create report %s\n", reportpath);
+			return -8;
+		}
+	}
+
+	if(listpath == NULL) {
+		int status = resamplegranule(geopath, hdfpath, opt);
+		if(opt.report) fclose(opt.report);
+		return status;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	// loop over all 4 data fields
+	// read the list of granules
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	for(iDataField=0; iDataField<4; iDataField++) {
-		printf("========================================================================\n");
-		printf("Data_field number = %i   name = %s\n", iDataField, dataFieldNames[iDataField]);
-		printf("------------------------------------------------------------------------\n");
-		ib = bandIndex[iDataField];                              // index of first band of this data field in bandNames[] array
-		nb = bandIndex[iDataField+1] - bandIndex[iDataField];    // number of bands in this data field
-
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		// make sure we have at least one band to resample in this data field
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		int nreadwrite = 0;
-		for(iband=0; iband<nb; iband++) {
-			if(isBand[ib+iband]>0) nreadwrite++;
-		}
-		if(nreadwrite==0) continue;   // if no bands to resample in this data field, continue
-
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		// read data to resample in this data field
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		status = readwrite_modis( &buffer1, &nx, &ny, nb, &(Scale_arr[ib]), &(Offset_arr[ib]), &(isBand[ib]),
-		                          dataFieldNames[iDataField], attrBaseNames[iDataField], hdfpath, 0);
-		if(status<0) {
-			printf("ERROR: Cannot read data field %s\n", dataFieldNames[iDataField]);
-			return 10*status;
-		}
-		if(latrows != ny || latcols != nx){
-			printf("ERROR: latitude image dimensions agree with band image\n");
-			return 2;
-		}
-
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		// allocate temporary arrays
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		inp_img  = allocate_2d_f(ny,nx);
-		maskNaN  = (int *) malloc(ny*nx*sizeof(int));
-		if( (maskNaN==NULL) || (inp_img==NULL)) {
-			printf("ERROR: Cannot allocate memory\n");
-			return -1;
-		}
-
-
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		// go through all the bands in the current data field
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		int iBandIndx = 0;
-		for(iband=0; iband<nb; iband++) {
-
-			// index of the current band in bandNames[] array is a sum of
-			//    index of first band of this data field in bandNames[] array and
-			//    index of band within the current data field
-			is = ib + iband;
-
-			// printf("iband = %i isband = %i\n", iband, isBand[is]);
-			if(isBand[is]==0) continue; // if no parameters for this band, then pass
-
-			buff1 = &(buffer1[iBandIndx*nx*ny]); // location of the current band data to resample
-			iBandIndx++;                         // increment the index of next band data to resample
-
-			printf("Band = %i  MODIS_band_number = %s   scale = %e  offset = %e\n", iband, bandNames[is], Scale_arr[is], Offset_arr[is]);
-
-			if(iDataField==3) {
-				int2bt(is, nx, ny, buff1, Offset_arr[is], Scale_arr[is], maskNaN, inp_img);
-
-				resample_modis(inp_img, lat, nx, ny, maskoverlap, sortoutput);
-				printf("Resampling done\n");
-
-				bt2int(is, nx, ny, inp_img, Offset_arr[is], Scale_arr[is], maskNaN, buff1);
-
-
-			}  //  if(iDataField==3)
-			else {
-				///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-				// reflective band
-				///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-				int2ref(nx, ny, buff1, Offset_arr[is], Scale_arr[is], inp_img);
-
-				resample_modis(inp_img, lat, nx, ny, maskoverlap, sortoutput);
-				printf("Resampling done\n");
-
-				ref2int(nx, ny, inp_img, Offset_arr[is], Scale_arr[is], buff1);
-
-			}  //  if(iDataField!=3) meaning reflective band
-
-			printf("------------------------------------------------------------------------\n");
-
-		} // for iband
-
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		// write resampled data back to hdf file, as well as set resampling attribute
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		status = readwrite_modis( &buffer1, &nx, &ny, nb, &(Scale_arr[ib]), &(Offset_arr[ib]), &(isBand[ib]),
-		                          dataFieldNames[iDataField], attrBaseNames[iDataField], hdfpath, 1);
-
-		if(status<0) {
-			printf("ERROR: Failed to write data\n");
-			return 10*status;
+	fp = fopen(listpath,"r");
+	if(fp==NULL) {
+		printf("ERROR: Cannot open granule list %s\n", listpath);
+		return -8;
+	}
+	int ngranule = 0, maxgranule = 0;
+	char **geopaths = NULL, **hdfpaths = NULL;
+	char geoname[1024], hdfname[1024];
+	while(fscanf(fp, "%1023s %1023s", geoname, hdfname) == 2) {
+		if(ngranule == maxgranule) {
+			maxgranule = 2*maxgranule + 16;
+			geopaths = (char **) realloc(geopaths, maxgranule*sizeof(char *));
+			hdfpaths = (char **) realloc(hdfpaths, maxgranule*sizeof(char *));
+			if(geopaths==NULL || hdfpaths==NULL) {
+				printf("ERROR: Cannot allocate memory\n");
+				return -1;
+			}
 		}
+		geopaths[ngranule] = strdup(geoname);
+		hdfpaths[ngranule] = strdup(hdfname);
+		ngranule++;
+	}
+	fclose(fp);
 
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		// clean up
-		///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-		if(buffer1!=NULL) {
-			free(buffer1);
-			buffer1 = NULL;
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	// resample the granules, a granule on each thread, in which case
+	// the bands within a granule are resampled on a single thread;
+	// with fewer granules than threads, that would leave threads
+	// idle, so the granules are resampled one after another, each
+	// with all the threads
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	int *gstatus = (int *) calloc(MAX(ngranule, 1), sizeof(int));
+	if(gstatus==NULL) {
+		printf("ERROR: Cannot allocate memory\n");
+		return -1;
+	}
+	GranuleBody granules(geopaths, hdfpaths, opt, gstatus);
+	if(ngranule < getNumThreads())
+		granules(Range(0, ngranule));
+	else
+		parallel_for_(Range(0, ngranule), granules, ngranule);
+
+	int nfailed = 0;
+	for(i=0; i<ngranule; i++) {
+		if(gstatus[i] != 0) {
+			printf("ERROR: Failed to resample granule %s %s\n", hdfpaths[i], geopaths[i]);
+			nfailed++;
 		}
-		free(inp_img[0]);
-		free(inp_img);
-		free(maskNaN);
-
-	} // for(iDataField = ...
-
-	if(sortoutput)
-		sortlatitude(argv[0]);
-
-	return 0;
+		free(geopaths[i]);
+		free(hdfpaths[i]);
+	}
+	printf("Resampled %i of %i granules\n", ngranule-nfailed, ngranule);
+	free(geopaths);
+	free(hdfpaths);
+	free(gstatus);
+	if(opt.report) fclose(opt.report);
+	return nfailed > 0 ? 1 : 0;
 }
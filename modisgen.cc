@@ -0,0 +1,232 @@
+//
+// Generator of synthetic MOD03 and MOD021KM granules
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <mfhdf.h>
+#include "modisresam.h"
+
+enum {
+	WIDTH = 1354,
+	NSCANS_GRANULE = 203,	// scans in a 5 minute granule
+};
+
+// The four data fields of a MOD021KM file with their number of bands,
+// the name of their scales and offsets attributes, and the index of
+// their first band in lambda.
+static struct {
+	const char	*name;
+	int	nband;
+	bool	emissive;
+	const char	*attr;
+	int	is;
+} fields[] = {
+	{"EV_250_Aggr1km_RefSB", 2, false, "reflectance", 0},
+	{"EV_500_Aggr1km_RefSB", 5, false, "reflectance", 2},
+	{"EV_1KM_RefSB", 15, false, "reflectance", 7},
+	{"EV_1KM_Emissive", 16, true, "radiance", 22},
+};
+
+static const char *progname;
+static unsigned int seed = 1;
+
+// Returns a pseudo-random number in [0, 1).
+static double
+urand(void)
+{
+	seed = seed*1103515245u + 12345u;
+	return ((seed >> 8) & 0xffff) / 65536.0;
+}
+
+// Make the latitude of a granule of ny rows starting at latitude lat0.
+// The latitude of the sorted granule increases smoothly along the track,
+// and each column is unsorted with the sorting indices of sort.h, so the
+// scans overlap the way the resampling expects.
+static void
+makelat(Mat &lat, int ny, float lat0)
+{
+	Mat sind;
+
+	getsortingind(sind, ny/SWATH_SIZE);
+	lat.create(ny, WIDTH, CV_32FC1);
+	for(int y = 0; y < ny; y++) {
+		const int *sp = sind.ptr<int>(y);
+		for(int x = 0; x < WIDTH; x++) {
+			// 1 km is about 0.009 degrees; the noise keeps the sorted order
+			lat.at<float>(sp[x], x) = lat0 + 0.0091*y + 0.0004*x + 0.006*(urand() - 0.5);
+		}
+	}
+}
+
+// Create the Latitude data record in the SD interface sd_id and write
+// lat into it.
+static void
+writelat(int32 sd_id, const Mat &lat)
+{
+	int32 dims[2] = {lat.rows, lat.cols};
+	int32 start[2] = {0, 0};
+	int32 sds_id;
+
+	sds_id = SDcreate(sd_id, "Latitude", DFNT_FLOAT32, 2, dims);
+	if(sds_id == FAIL)
+		eprintf("cannot create Latitude");
+	if(SDwritedata(sds_id, start, NULL, dims, (VOIDP)lat.data) == FAIL)
+		eprintf("cannot write Latitude");
+	SDendaccess(sds_id);
+}
+
+// Make band ib of field i with the scale and offset of the band, from
+// the latitude lat. Reflective bands hold smooth reflectances with a few
+// saturated pixels, emissive bands hold the radiances of smooth
+// brightness temperatures with a few pixels of negative radiance.
+static void
+makeband(Mat &band, int i, int ib, const Mat &lat, float scale, float offset)
+{
+	BandConv c;
+
+	convert_setup(c, fields[i].is + ib, fields[i].emissive, false, offset, scale);
+	band.create(lat.rows, lat.cols, CV_16UC1);
+	for(int y = 0; y < lat.rows; y++) {
+		const float *lp = lat.ptr<float>(y);
+		unsigned short *bp = band.ptr<unsigned short>(y);
+		for(int x = 0; x < lat.cols; x++) {
+			double v;
+			if(c.emissive) {
+				double bt = 270 + 15*sin(2*lp[x] + 0.3*ib) + 5*cos(0.005*x) + urand();
+				v = c.r2/(exp(c.r1/bt) - 1)/scale + offset;
+				if(urand() < 0.002)
+					v = offset - 50*urand();
+			} else {
+				double ref = 0.3 + 0.2*sin(3*lp[x] + ib) + 0.1*cos(0.01*x) + 0.02*urand();
+				v = ref/scale + offset;
+				if(urand() < 0.001)
+					v = 65533;	// saturated
+			}
+			bp[x] = (unsigned short)MAX(0, MIN(v, 65535));
+		}
+	}
+}
+
+// Create field i in the SD interface sd_id for a granule with latitude lat,
+// and fill it one band at a time.
+static void
+writefield(int32 sd_id, int i, const Mat &lat)
+{
+	int nband = fields[i].nband;
+	int32 dims[3] = {nband, lat.rows, lat.cols};
+	int32 start[3] = {0, 0, 0};
+	int32 edge[3] = {1, lat.rows, lat.cols};
+	float scales[16], offsets[16];
+	char attr[64];
+	int32 sds_id;
+	Mat band;
+
+	sds_id = SDcreate(sd_id, fields[i].name, DFNT_UINT16, 3, dims);
+	if(sds_id == FAIL)
+		eprintf("cannot create %s", fields[i].name);
+
+	for(int ib = 0; ib < nband; ib++) {
+		if(fields[i].emissive) {
+			// keep the radiance of 330 K below the largest valid integer
+			BandConv c;
+			convert_setup(c, fields[i].is + ib, true, false, 0, 1);
+			offsets[ib] = 1500 + 20*ib;
+			scales[ib] = c.r2/(exp(c.r1/330) - 1)/(32767 - offsets[ib]);
+		} else {
+			offsets[ib] = 100*(ib%3);
+			scales[ib] = 4e-5*(1 + 0.05*ib);
+		}
+		makeband(band, i, ib, lat, scales[ib], offsets[ib]);
+		start[0] = ib;
+		if(SDwritedata(sds_id, start, NULL, edge, (VOIDP)band.data) == FAIL)
+			eprintf("cannot write band %d of %s", ib, fields[i].name);
+	}
+
+	sprintf(attr, "%s_scales", fields[i].attr);
+	if(SDsetattr(sds_id, attr, DFNT_FLOAT32, nband, scales) == FAIL)
+		eprintf("cannot set %s of %s", attr, fields[i].name);
+	sprintf(attr, "%s_offsets", fields[i].attr);
+	if(SDsetattr(sds_id, attr, DFNT_FLOAT32, nband, offsets) == FAIL)
+		eprintf("cannot set %s of %s", attr, fields[i].name);
+	SDendaccess(sds_id);
+}
+
+static void
+usage()
+{
+	printf("usage: %s [flags] MOD03_hdf_file MODIS_hdf_file\n", progname);
+	printf("\n");
+	printf("Write a synthetic granule for testing modisresam: the Latitude of\n");
+	printf("MOD03_hdf_file, with scans that overlap as in sort.h, and the four EV_*\n");
+	printf("data fields of MODIS_hdf_file with their scales and offsets.\n");
+	printf("\n");
+	printf("	-n n	number of scans of %d rows (default %d)\n", SWATH_SIZE, NSCANS_GRANULE);
+	printf("	-l lat	latitude of the first row (default 30)\n");
+	printf("	-r n	seed of the pseudo-random numbers (default 1)\n");
+	exit(2);
+}
+
+#define GETARG(x)	do{\
+		(x) = *argv++;\
+		argc--;\
+	}while(0);
+
+int
+main(int argc, char** argv)
+{
+	char *flag;
+	int nscans = NSCANS_GRANULE;
+	float lat0 = 30;
+	int32 sd_id;
+	Mat lat;
+
+	GETARG(progname);
+	while(argc > 0 && strlen(argv[0]) == 2 && argv[0][0] == '-') {
+		GETARG(flag);
+		if(argc < 1)
+			usage();
+
+		switch(flag[1]) {
+		default:
+			usage();
+			break;
+		case 'n':
+			GETARG(flag);
+			nscans = atoi(flag);
+			if(nscans < 2)
+				usage();
+			break;
+		case 'l':
+			GETARG(flag);
+			lat0 = atof(flag);
+			break;
+		case 'r':
+			GETARG(flag);
+			seed = atoi(flag);
+			break;
+		}
+	}
+	if(argc != 2)
+		usage();
+
+	makelat(lat, nscans*SWATH_SIZE, lat0);
+
+	sd_id = SDstart(argv[0], DFACC_CREATE);
+	if(sd_id == FAIL)
+		eprintf("cannot create %s", argv[0]);
+	writelat(sd_id, lat);
+	if(SDend(sd_id) == FAIL)
+		eprintf("cannot write %s", argv[0]);
+
+	sd_id = SDstart(argv[1], DFACC_CREATE);
+	if(sd_id == FAIL)
+		eprintf("cannot create %s", argv[1]);
+	for(int i = 0; i < (int)nelem(fields); i++)
+		writefield(sd_id, i, lat);
+	if(SDend(sd_id) == FAIL)
+		eprintf("cannot write %s", argv[1]);
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <opencv2/opencv.hpp>
 
 using namespace cv;
@@ -9,28 +10,312 @@ using namespace cv;
 #define	nelem(x)	(sizeof(x)/sizeof((x)[0]))
 #define	CHECKMAT(M, T)	CV_Assert((M).type() == (T) && (M).isContinuous())
 
+// Packed pixel masks hold pixel i in bit i%8 of byte i/8, the order in
+// which _mm256_movemask_ps packs 8 lanes.
+#define	MASKBYTES(n)	(((size_t)(n)+7)/8)
+#define	MASKGET(m, i)	((m)[(i)>>3]>>((i)&7) & 1)
+
 enum {
 	SWATH_SIZE = 10,
+	PIPE_DEPTH = 2,		// blocks read ahead and written behind by a ModisPipe
+	WRITE_GAP = 2,		// runs of changed rows fewer than WRITE_GAP unchanged rows apart are written as one
 };
 
 // allocate_2d.cc
 float	** allocate_2d_f(int n1, int n2);
 int	**allocate_2d_i(int n1, int n2);
 
+// arena.cc
+
+// Arena of buffers allocated from chunks of memory that are kept when
+// the arena is reset, so that the buffers of each data field reuse the
+// memory, and the pages, of the previous data field.
+struct Arena {
+	char	*chunk;	// newest chunk, which links to the older ones
+	size_t	size;	// bytes in the newest chunk
+	size_t	used;	// bytes used in the newest chunk
+	size_t	total;	// bytes handed out since the arena was reset
+	size_t	peak;	// largest total so far
+	bool	hugepages;	// back the chunks by transparent huge pages
+};
+
+void	arena_init(Arena &a, bool hugepages);
+void	*arena_alloc(Arena &a, size_t n);
+void	arena_mat(Arena *a, Mat &m, int rows, int cols, int type);
+void	arena_reset(Arena &a);
+void	arena_free(Arena &a);
+
 // readwrite_modis.cc
 int	readwrite_modis(unsigned short ** buffer, int * nx, int * ny, int nband, float *scales, float *offsets,
                     int *isband, char * sds_name, char * attr_name, char * filename, int readwrite);
-int	readlatitude(float ** buffer, int *nx, int *ny, const char *filename);
-int	writelatitude(const Mat &lat, const char *filename);
+// HDF4 file opened with hdf_open.
+struct HdfFile {
+	int	sd_id;		// SD interface identifier
+	int	nsds;		// number of data records selected
+	int	sds_ids[8];	// data set identifiers of the selected data records
+	char	sds_names[8][64];
+};
+
+// Data record of a MODIS HDF4 file opened with modis_open.
+struct ModisField {
+	int	sds_id;		// data set identifier
+	int	nx, ny;		// size of the image of each band
+	int	nband;		// number of bands in data record
+	int	nreadwrite;	// number of bands read/written
+	int	*isband;	// read/write band i if isband[i] != 0
+	char	*sds_name;
+	int	readwrite;	// opened for writing
+};
+
+int	hdf_open(HdfFile &h, const char *filename, int readwrite);
+int	hdf_select(HdfFile &h, const char *sds_name);
+int	hdf_close(HdfFile &h);
+int	modis_open(ModisField &f, HdfFile &h, int nband, float *scales, float *offsets,
+	int *isband, char *sds_name, char *attr_name, int readwrite);
+int	modis_rows(ModisField &f, unsigned short *buffer, int y0, int nrows, int readwrite);
+int	modis_changedrows(ModisField &f, const unsigned short *buffer, int y0, int nrows, const Mat &changed);
+int	modis_close(ModisField &f);
+
+// Blocks of rows of a data record opened with modis_open, read ahead
+// and written back by a separate I/O thread.
+struct ModisPipe {
+	ModisField	*f;
+	int	blockrows;	// number of rows in each block but the last
+	int	nblock;		// number of blocks in the data record
+	bool	write;		// blocks are written back
+	Mat	in[PIPE_DEPTH], out[PIPE_DEPTH];
+	const Mat	*changed;	// rows of each band written back, or NULL for all rows
+	int	nread, nused;	// blocks read by the I/O thread and released
+	int	nfilled, nwritten;	// blocks filled and written by the I/O thread
+	bool	stop;		// no more blocks are filled
+	int	status;		// first error of the I/O thread
+	double	readsec, writesec;	// time spent reading and writing by the I/O thread
+	double	waitsec;	// time spent waiting for the I/O thread
+	long	nbytesread, nbyteswritten;
+	pthread_t	thread;
+	pthread_mutex_t	mu;
+	pthread_cond_t	cond;
+};
+
+int	pipe_start(ModisPipe &p, ModisField &f, int blockrows, bool write, Arena *a);
+unsigned short	*pipe_read(ModisPipe &p, int k);
+void	pipe_release(ModisPipe &p);
+unsigned short	*pipe_outbuf(ModisPipe &p, int k);
+void	pipe_filled(ModisPipe &p);
+int	pipe_finish(ModisPipe &p);
+int	readlatitude(float ** buffer, int *nx, int *ny, HdfFile &h);
+int	writelatitude(const Mat &lat, HdfFile &h);
+
+// cube.cc
+
+// A cube holds resampled bands as raw scaled integers for mapping into
+// memory with mmap. It starts with a CubeHeader in a block of CUBE_ALIGN
+// bytes, followed by each band, then by the latitude as floats. Each
+// band and the latitude start at a multiple of CUBE_ALIGN bytes and
+// are stored row by row without padding. All numbers are in the byte
+// order of the machine that wrote the cube. magic is only set once the
+// whole cube has been written.
+enum {
+	CUBE_ALIGN = 4096,
+	CUBE_VERSION = 1,
+	CUBE_MAXBAND = 38,
+};
+
+struct CubeHeader {
+	char	magic[8];	// "MODCUBE"
+	int32_t	version;	// CUBE_VERSION
+	int32_t	nx, ny;		// size of each band and of the latitude
+	int32_t	nband;		// number of bands
+	int32_t	sorted;		// rows are in sorted order, as with -s
+	int32_t	pad;
+	int64_t	planesize;	// bytes from the start of a band to the next
+	int64_t	latoffset;	// offset of the latitude
+	struct {
+		char	name[8];	// MODIS band number, as in bands.txt
+		float	scale, offset;	// physical value is scale*(integer - offset)
+		int64_t	dataoffset;	// offset of the band
+	} bands[CUBE_MAXBAND];
+};
+
+// Cube being written.
+struct Cube {
+	char	*path;
+	int	fd;
+	char	*base;	// mapping of the whole file
+	size_t	size;
+	CubeHeader	*h;
+};
+
+int	cube_create(Cube &c, const char *path, int nx, int ny, int nband, bool sorted);
+unsigned short	*cube_band(Cube &c, int b);
+float	*cube_latitude(Cube &c);
+void	cube_putrows(Cube &c, int b0, int nband, const unsigned short *buf, size_t bandstride,
+	int y0, int nrows);
+int	cube_close(Cube &c, bool ok);
 
 // utils.cc
+bool	haveavx2(void);
+double	nowsec(void);
+long	peakrss(void);
 const char	*type2str(int type);
 void	eprintf(const char *fmt, ...);
+char	*estrdup(const char *s);
+void	*emalloc(size_t n);
 void	dumpmat(const char *filename, Mat &m);
 void	dumpfloat(const char *filename, float *buf, int nbuf);
 
+// convert.cc
+
+// Conversion of one band between scaled integers and physical values,
+// set up by convert_init (or convert_setup, convert_scan and
+// convert_tables) for converting a row of pixels at a time.
+struct BandConv {
+	bool	emissive;	// physical values are brightness temperatures
+	bool	fast;		// use the fast approximate conversion
+	float	offset, scale;
+	float	r1, r2;		// constants of the Planck function
+	int	jmin;		// smallest integer with a physical radiance
+	int	jmax;		// largest integer
+	Mat	btlut;		// brightness temperatures of integers jmin, jmin+1, ...
+	int	a, nt;		// integers a..a+nt are looked up in thr
+	Mat	thr;		// smallest brightness temperature of each integer
+	Mat	bucket;		// index of thr by brightness temperature
+	float	base, inv;	// map brightness temperature to bucket
+};
+
+extern double	lambda[38];
+void	convert_setup(BandConv &c, int is, bool emissive, bool fast, float offset, float scale);
+int	convert_scan(BandConv &c, const unsigned short *buff1, int n);
+void	convert_tables(BandConv &c);
+int	convert_init(BandConv &c, int is, bool emissive, bool fast, const unsigned short *buff1, int n,
+	float offset, float scale);
+void	convert_row(const BandConv &c, const unsigned short *in, float *out, int n);
+int	convert_row_back(const BandConv &c, const float *in, const unsigned short *orig,
+	unsigned short *out, int n);
+int	int2bt(int is, int nx, int ny, unsigned short *buff1, float offset, float scale,
+	unsigned char *maskNaN, float **inp_img, int ib, bool fast);
+int	bt2int(int is, int nx, int ny, float **outp_img, float offset, float scale, const unsigned char *maskNaN,
+	unsigned short *buff1, int ib, bool fast);
+void	int2ref(int nx, int ny, unsigned short *buff1, float offset, float scale, float **inp_img, int ib);
+int	ref2int(int nx, int ny, float **outp_img, float offset, float scale, unsigned short *buff1, int ib);
+
 // resample_modis.cc
+
+// Latitude sorting indices stored as segments. Sorting reorders the
+// rows of whole groups of columns, so a sorted row is made of a few
+// runs of columns taken from the same row. Segment k covers columns
+// seg(k, 0) .. seg(k, 1)-1 and is taken from row seg(k, 2); the
+// segments of sorted row i are off(i) .. off(i+1)-1. The inverse
+// permutation is stored the same way in useg and uoff.
+struct SortIndex {
+	int	rows, cols;
+	Mat	seg, off;	// segments of each sorted row
+	Mat	useg, uoff;	// segments of each unsorted row
+	int	maxdisp;	// largest distance between a row and its sorted row
+};
+
+// Pixels that resampling changes, by output row: the pixels of row y
+// are off(y) .. off(y+1)-1 of pix and lam. Each pixel of pix holds its
+// column and the rows of the previous and next pixel of its sorted
+// column; see touch_init.
+struct TouchList {
+	Mat	pix;	// column, previous and next row of each pixel
+	Mat	lam;	// interpolation weight of each pixel
+	Mat	off;	// first pixel of each row
+	bool	maskoverlap;	// the overlapping pixels are masked
+};
+
+// State shared by all bands resampled with the same latitude.
+struct ResampleContext {
+	Mat	lat;	// original latitude
+	SortIndex	sind;	// latitude sorting indices
+	Mat	slat;	// sorted latitude
+	Mat	lam;	// interpolation weights of sorted latitude
+	Mat	simg;	// sorted image (scratch)
+	Mat	dst;	// resampled image (scratch)
+	TouchList	touch;	// pixels changed by resampling, set up by touch_init
+};
+
 void	getsortingind(Mat &sind, int swaths);
-Mat	resample_sort(const Mat &sind, const Mat &img);
-void	resample_modis(float **_img, float *_lat, int nx, int ny,
+void	getlatsortingind(Mat &sind, const Mat &lat);
+void	sortind_init(SortIndex &si, const Mat &sind);
+Mat	resample_sort(const SortIndex &si, const Mat &img);
+void	resample_sort(const SortIndex &si, const Mat &img, Mat &newimg);
+void	resample_unsort(const SortIndex &si, const Mat &img, Mat &newimg);
+int	resample2d(const Mat &ssrc, const Mat &lam, const SortIndex &sortidx, Mat &dst);
+void	setoverlaps1km(Mat &dst, float value);
+void	resample_init(ResampleContext &r, const Mat &lat, bool latsort);
+int	resample_bands(ResampleContext &r, float **_img, int nband, bool maskoverlap, bool sortoutput);
+int	touch_init(TouchList &t, const ResampleContext &r, bool maskoverlap);
+// Stages of resampling a band timed by a SwathStream.
+enum {
+	ST_CONVERT,	// scaled integers to physical values
+	ST_SORT,
+	ST_RESAMPLE,
+	ST_UNSORT,
+	ST_CONVBACK,	// physical values back to scaled integers
+	NSTAGE,
+};
+
+// Time spent in each stage of resampling a band, in seconds.
+struct BandTimes {
+	double	sec[NSTAGE];
+};
+
+// Number of pixels of a band with each data-quality problem.
+struct BandStats {
+	int	nnan;		// pixels that could not be resampled
+	int	nclamped;	// values outside the range of the integers, set to 65535
+	int	nnegative;	// pixels with negative radiance, kept from the input
+	int	noverlap;	// overlapping pixels masked with NAN
+};
+
+// State of resampling bands stored as scaled integers a swath at a time.
+struct SwathStream {
+	const ResampleContext	*r;
+	const BandConv	*conv;	// conversion of each band
+	int	nband;
+	bool	maskoverlap, sortoutput;
+	int	nswath;	// number of swaths in the granule
+	int	nin, nsimg, ndst, nout;	// next swath of each stage
+	int	ringin;	// number of swaths in the ring of input swaths
+	Mat	in;	// ring of input swaths
+	Mat	simg;	// ring of sorted swaths
+	Mat	dst;	// ring of resampled swaths
+	Mat	scratch;	// scratch rows of each band
+	Mat	nnan;	// pixels not resampled per band and sorted row
+	Mat	nclamped;	// values clamped per band and output row, or sorted row of integer bands
+	Mat	noverlap;	// overlapping pixels masked per band and sorted row
+	Mat	changed;	// output rows of each band that differ from the input
+	Mat	gaps;	// bitmap of the pixels not resampled in any band, or empty
+	BandTimes	*times;	// time of each band, or NULL if not timed
+	const TouchList	*touch;	// resample only these pixels, or NULL for all
+};
+
+int	stream_init(SwathStream &s, const ResampleContext &r, int nband, const BandConv *conv,
+	bool maskoverlap, bool sortoutput, const TouchList *touch, int first, Arena *a);
+void	stream_push(SwathStream &s, const unsigned short *in, size_t bandstride);
+int	stream_ready(SwathStream &s);
+int	stream_pull(SwathStream &s, unsigned short *out, size_t bandstride);
+void	stream_stats(const SwathStream &s, int k0, int k1, BandStats *stats);
+void	stream_finish(SwathStream &s);
+void	resample_bands16(ResampleContext &r, const unsigned short *in, unsigned short *out, int nband,
+	const BandConv *conv, bool maskoverlap, bool sortoutput, BandStats *stats);
+int	resample_modis(ResampleContext &r, float **_img, bool maskoverlap, bool sortoutput);
+int	resample_modis(float **_img, float *_lat, int nx, int ny,
 	bool maskoverlap, bool sortoutput);
+
+// geocache.cc
+
+// Cache file of the latitude of a geolocation file and of the state
+// derived from it, mapped into memory by geocache_load.
+struct GeoCache {
+	struct GeoCacheHeader	*key;	// key and header of the cache file
+	char	*path;	// cache file
+	void	*base;	// mapping of the cache file, or NULL
+	size_t	size;
+};
+
+int	geocache_load(GeoCache &gc, const char *dir, const char *geopath, bool latsort, ResampleContext &r);
+int	geocache_store(GeoCache &gc, const ResampleContext &r);
+void	geocache_close(GeoCache &gc);
@@ -4,6 +4,11 @@
 
 #define MAX_STR_LEN 256
 
+// The HDF4 library is not thread-safe, so all calls into it from
+// the functions below are serialized when granules are resampled on
+// several threads.
+static Mutex hdflock;
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // This subroutine reads/writes MODIS data from/to HDF4 file as unsigned short (2 byte unsigned integer)
@@ -49,42 +54,199 @@
 int readwrite_modis(unsigned short ** buffer, int * nx, int * ny, int nband, float *scales, float *offsets,
                     int *isband, char * sds_name, char * attr_name, char * filename, int readwrite)
 {
+	HdfFile h;
+	ModisField f;
+	int status, iprint = 0;
 
-	int32 sd_id, sds_index, sds_id; /* SD interface and data set identifiers */
-	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
-	int i, iprint = 0;
+	status = hdf_open(h, filename, readwrite);
+	if(status<0) return status;
+	int nreadwrite = modis_open(f, h, nband, scales, offsets, isband, sds_name, attr_name, readwrite);
+	if(nreadwrite<=0) {
+		hdf_close(h);
+		return nreadwrite;
+	}
+	*ny = f.ny;
+	*nx = f.nx;
 
 
-	// find how many bands need to be read/written
-	int nreadwrite = 0;
-	for(i=0; i<nband; i++) {
-		if(isband[i]>0) nreadwrite++;
+	// if reading, allocate buffer for data
+	int ntot = f.ny * f.nx * nreadwrite;
+	if(readwrite==0) {
+		buffer[0] = NULL;
+		buffer[0] = (unsigned short *) malloc(ntot*sizeof(unsigned short));
+		if(buffer[0]==NULL) {
+			if(iprint > 0) printf("Cannot allocate memory %lu bytes\n", ntot*sizeof(unsigned short));
+			modis_close(f);
+			hdf_close(h);
+			return -1;
+		}
 	}
-	if(iprint > 0) printf("nreadwrite = %i\n", nreadwrite);
-	if(nreadwrite==0) return 0;
 
+	// the data record and the file are closed even if reading or
+	// writing failed; bands that were not all written are not marked
+	// as resampled
+	status = modis_rows(f, buffer[0], 0, f.ny, readwrite);
+	if(status<0) f.readwrite = 0;
+	int cstatus = modis_close(f);
+	if(status>=0) status = cstatus;
+	cstatus = hdf_close(h);
+	if(status>=0) status = cstatus;
+	if(status<0) {
+		if(readwrite==0) {
+			free(buffer[0]);
+			buffer[0] = NULL;
+		}
+		return status;
+	}
+
+	if(iprint > 0) printf("modis_readwrite done \n");
+	return nreadwrite;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine opens HDF4 file filename for reading/writing all its data records, so that each
+// file is only opened once. If readwrite == 0, the file is opened for reading; otherwise for reading
+// and writing.
+//
+// Return value:
+// Upon sucessful completion, returns 0; negative return value indicates error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int hdf_open(HdfFile &h, const char *filename, int readwrite)
+{
+	AutoLock lock(hdflock);
+	int iprint = 0;
 
-	// open file for read or write
-	if (readwrite==0) sd_id = SDstart(filename, DFACC_READ);
-	else              sd_id = SDstart(filename, DFACC_WRITE);
-	if(sd_id==FAIL) {
+	h.sd_id = SDstart(filename, readwrite==0 ? DFACC_READ : DFACC_WRITE);
+	if(h.sd_id==FAIL) {
 		if(iprint > 0) printf("Cannot open file %s with SDstart\n", filename);
 		return -1;
 	}
+	h.nsds = 0;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine returns the identifier of data record sds_name of a file opened with hdf_open.
+// The data record is only selected the first time; hdf_close ends access to it.
+//
+// Return value:
+// Upon sucessful completion, returns the data set identifier; FAIL indicates error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+static int sdselect(HdfFile &h, const char *sds_name)
+{
+	int32 sds_index, sds_id;
+	int i, iprint = 0;
+
+	for(i=0; i<h.nsds; i++) {
+		if(strcmp(h.sds_names[i], sds_name) == 0) return h.sds_ids[i];
+	}
+	if(h.nsds==(int)nelem(h.sds_ids)) {
+		printf("ERROR: too many data records selected\n");
+		return FAIL;
+	}
 
 
 	// find the index of data record
-	sds_index = SDnametoindex(sd_id, sds_name);
+	sds_index = SDnametoindex(h.sd_id, sds_name);
 	if(sds_index==FAIL) {
 		if(iprint > 0) printf("Cannot get index of %s with SDnametoindex\n", sds_name);
-		return -1;
+		return FAIL;
 	}
 
 
 	// open the data record
-	sds_id = SDselect(sd_id, sds_index);
+	sds_id = SDselect(h.sd_id, sds_index);
 	if(sds_id==FAIL) {
 		if(iprint > 0) printf("Cannot select data set with SDselect\n");
+		return FAIL;
+	}
+	snprintf(h.sds_names[h.nsds], sizeof(h.sds_names[h.nsds]), "%s", sds_name);
+	h.sds_ids[h.nsds++] = sds_id;
+	return sds_id;
+}
+
+int hdf_select(HdfFile &h, const char *sds_name)
+{
+	AutoLock lock(hdflock);
+	return sdselect(h, sds_name);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine ends access to the data records of a file opened with hdf_open and closes it.
+//
+// Return value:
+// Upon sucessful completion, returns 0; negative return value indicates error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int hdf_close(HdfFile &h)
+{
+	AutoLock lock(hdflock);
+	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
+	int i, iprint = 0, ret = 0;
+
+	// close data records
+	for(i=0; i<h.nsds; i++) {
+		status = SDendaccess(h.sds_ids[i]);
+		if(status==FAIL) {
+			if(iprint > 0) printf("Cannot end access with SDendaccess\n");
+			ret = -1;
+		}
+	}
+	h.nsds = 0;
+
+	// close hdf4 file access
+	status = SDend(h.sd_id);
+	if(status==FAIL) {
+		if(iprint > 0) printf("Cannot end with SDend\n");
+		return -1;
+	}
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine opens a MODIS data record in HDF4 file h for reading/writing blocks of rows
+// with modis_rows. The arguments are the same as for readwrite_modis, except:
+//
+// ModisField &         f           OUT       On output contains the open data record, with its
+//                                            dimensions in f.nx and f.ny
+//
+// HdfFile &            h           IN        File opened with hdf_open
+//
+// int                  readwrite   IN        if readwrite == 0, open for reading
+//                                            if readwrite != 0, open for reading and writing;
+//                                            modis_close sets the resampling attribute
+//
+// Return value:
+// Upon sucessful completion, returns a non-negative number equal to the number of bands to read/write;
+// negative return value indicates error; f must be closed with modis_close if the return value is
+// positive, and may be closed after an error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int modis_open(ModisField &f, HdfFile &h, int nband, float *scales, float *offsets,
+               int *isband, char * sds_name, char * attr_name, int readwrite)
+{
+	AutoLock lock(hdflock);
+
+	int32 sds_id; /* data set identifier */
+	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
+	int i, iprint = 0;
+
+	// nothing is written by modis_close until the data record is open
+	f.sds_id = FAIL;
+	f.readwrite = 0;
+
+
+	// find how many bands need to be read/written
+	int nreadwrite = 0;
+	for(i=0; i<nband; i++) {
+		if(isband[i]>0) nreadwrite++;
+	}
+	if(iprint > 0) printf("nreadwrite = %i\n", nreadwrite);
+	if(nreadwrite==0) return 0;
+
+
+	// open the data record
+	sds_id = sdselect(h, sds_name);
+	if(sds_id==FAIL) {
+		if(iprint > 0) printf("Cannot select data set %s\n", sds_name);
 		return -1;
 	}
 
@@ -162,59 +324,96 @@ int readwrite_modis(unsigned short ** buffer, int * nx, int * ny, int nband, flo
 	if(iprint > 0) printf("datatype = %i\n", data_type);
 
 	// dimsizes[0] is number of bands in data record
-	*ny = dimsizes[1];
-	*nx = dimsizes[2];
+	f.ny = dimsizes[1];
+	f.nx = dimsizes[2];
+
+	f.sds_id = sds_id;
+	f.nband = nband;
+	f.nreadwrite = nreadwrite;
+	f.isband = isband;
+	f.sds_name = sds_name;
+	f.readwrite = readwrite;
+	return nreadwrite;
+}
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine reads/writes rows y0..y0+nrows-1 of the bands of a data record opened with
+// modis_open. The rows of the n-th band read/written are at buffer[n*nrows*nx], so reading
+// all rows gives the same array as readwrite_modis.
+//
+// Return value:
+// Upon sucessful completion, returns 0; negative return value indicates error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int modis_rows(ModisField &f, unsigned short * buffer, int y0, int nrows, int readwrite)
+{
+	AutoLock lock(hdflock);
+	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
+	int i, iprint = 0;
 
-	// if reading, allocate buffer for data
-	int ntot = dimsizes[1] * dimsizes[2] * nreadwrite;
-	if(readwrite==0) {
-		buffer[0] = NULL;
-		buffer[0] = (unsigned short *) malloc(ntot*sizeof(unsigned short));
-		if(buffer[0]==NULL) {
-			if(iprint > 0) printf("Cannot allocate memory %lu bytes\n", ntot*sizeof(unsigned short));
-			return -1;
-		}
+	if(y0<0 || nrows<0 || y0+nrows>f.ny) {
+		printf("ERROR: rows %i..%i outside of %s\n", y0, y0+nrows-1, f.sds_name);
+		return -1;
 	}
 
-	int32 start[3]  = { 0, 0, 0 };
+	int32 start[3]  = { 0, y0, 0 };
 	int32 stride[3] = { 1, 1, 1 };
-	int32 edge[3]   = { 1, dimsizes[1], dimsizes[2] };
+	int32 edge[3]   = { 1, nrows, f.nx };
+	long nblock = (long)nrows*f.nx;
 
 
-	// read / write bands
+	// read / write runs of consecutive bands, each with one call
 	int nb = 0;
-	for(i=0; i<nband; i++) {
-		if(isband[i]==0) continue;   // skip bands that are not needed
-		start[0] = i;                // start index of band in data record in file
+	for(i=0; i<f.nband; i+=edge[0]) {
+		edge[0] = 1;
+		if(f.isband[i]==0) continue;   // skip bands that are not needed
+		while(i+edge[0]<f.nband && f.isband[i+edge[0]]!=0) edge[0]++;
+		start[0] = i;                  // start index of band in data record in file
 		// nb is here used as an index of band in memory
 		if(readwrite == 0) {
-			status =  SDreaddata(sds_id, start, stride, edge, (VOIDP) &(buffer[0][nb*dimsizes[1]*dimsizes[2]]) );
+			status =  SDreaddata(f.sds_id, start, stride, edge, (VOIDP) &buffer[nb*nblock]);
 			if(status==FAIL) {
 				if(iprint > 0) printf("Cannot  read data with SDreaddata\n");
 				return -1;
 			}
 		} else {
-			status = SDwritedata(sds_id, start, stride, edge, (VOIDP) &(buffer[0][nb*dimsizes[1]*dimsizes[2]]) );
+			status = SDwritedata(f.sds_id, start, stride, edge, (VOIDP) &buffer[nb*nblock]);
 			if(status==FAIL) {
 				if(iprint > 0) printf("Cannot write data with SDwritedata\n");
 				return -1;
 			}
 		}
-		nb++;
+		nb += edge[0];
 	}
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine finishes with a data record opened with modis_open. If it was opened for writing,
+// the "Resampling" attribute of the data record is set for the bands written. The data record stays
+// selected until its file is closed with hdf_close.
+//
+// Return value:
+// Upon sucessful completion, returns 0; negative return value indicates error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int modis_close(ModisField &f)
+{
+	AutoLock lock(hdflock);
+	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
+	int i, iprint = 0;
+	int32 sds_id = f.sds_id;
 
 
 	// now deal with resampling attribute
-	if(readwrite==1) {
+	if(f.readwrite!=0) {
 
 		// first, try to find an existing resampling attribute
+		char full_attr_name[MAX_STR_LEN];
 		sprintf(full_attr_name, "Resampling");
 		float attrbuff[32];
-		for(i=0; i<nband; i++) {
+		for(i=0; i<f.nband; i++) {
 			attrbuff[i] = 0;
 		}
-		attr_index = SDfindattr (sds_id, full_attr_name);
+		intn attr_index = SDfindattr (sds_id, full_attr_name);
 		if(attr_index!=FAIL) {
 
 			// we need to read the values of this attribute and modify those of resampled bands
@@ -226,70 +425,273 @@ int readwrite_modis(unsigned short ** buffer, int * nx, int * ny, int nband, flo
 		}
 
 		// modify attribute for resampled bands
-		for(i=0; i<nband; i++) {
-			if(isband[i]==0) continue;
+		for(i=0; i<f.nband; i++) {
+			if(f.isband[i]==0) continue;
 			if(attrbuff[i]>0) {
-				printf("WARNING: This band %i in data field %s was already resampled\n", i, sds_name);
+				printf("WARNING: This band %i in data field %s was already resampled\n", i, f.sds_name);
 			}
-			attrbuff[i] = (float) isband[i];
+			attrbuff[i] = (float) f.isband[i];
 		}
 
 		// write the modified attributes back to the data record
-		status = SDsetattr(sds_id, full_attr_name, DFNT_FLOAT32, nband, attrbuff);
+		status = SDsetattr(sds_id, full_attr_name, DFNT_FLOAT32, f.nband, attrbuff);
 		if(status==FAIL) {
 			if(iprint > 0) printf("Cannot write attribute with SDsetattr\n");
 			return -2;
 		}
 
-	} // if(readwrite==1)
+	} // if(f.readwrite!=0)
 	// done with resampling attribute
 
+	return 0;
+}
 
-	// close data record
-	status = SDendaccess(sds_id);
-	if(status==FAIL) {
-		if(iprint > 0) printf("Cannot end access with SDendaccess\n");
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine writes the rows y0 .. y0+nrows-1 of the bands of data record f that are set in the
+// CV_8UC1 image changed, which has a row for each band read and a column for each row. buffer holds
+// all the rows of the bands as for modis_rows. Runs of changed rows of a band are written with one call
+// each; runs that are fewer than WRITE_GAP unchanged rows apart are joined.
+//
+// Return value:
+// Upon sucessful completion, returns the number of rows written of all bands; negative return value
+// indicates error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int modis_changedrows(ModisField &f, const unsigned short *buffer, int y0, int nrows, const Mat &changed)
+{
+	AutoLock lock(hdflock);
+	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
+	int i, y, y1, nb, nwritten = 0, iprint = 0;
+
+	if(y0<0 || nrows<0 || y0+nrows>f.ny) {
+		printf("ERROR: rows %i..%i outside of %s\n", y0, y0+nrows-1, f.sds_name);
 		return -1;
 	}
+	CHECKMAT(changed, CV_8UC1);
 
-	// close hdf4 file access
-	status = SDend(sd_id);
-	if(status==FAIL) {
-		if(iprint > 0) printf("Cannot end with SDend\n");
-		return -1;
+	int32 start[3]  = { 0, 0, 0 };
+	int32 stride[3] = { 1, 1, 1 };
+	int32 edge[3]   = { 1, 0, f.nx };
+	long nblock = (long)nrows*f.nx;
+
+	nb = 0;
+	for(i=0; i<f.nband; i++) {
+		if(f.isband[i]==0) continue;   // skip bands that are not needed
+		const unsigned char *cp = changed.ptr<unsigned char>(nb);
+		for(y=y0; y<y0+nrows; y=y1) {
+			if(!cp[y]) {
+				y1 = y+1;
+				continue;
+			}
+			// extend the run over the changed rows and short gaps
+			for(y1=y+1; y1<y0+nrows; y1++) {
+				int gap = 0;
+				while(y1+gap<y0+nrows && gap<WRITE_GAP && !cp[y1+gap]) gap++;
+				if(y1+gap==y0+nrows || gap==WRITE_GAP) break;
+				y1 += gap;
+			}
+			start[0] = i;
+			start[1] = y;
+			edge[1] = y1-y;
+			status = SDwritedata(f.sds_id, start, stride, edge, (VOIDP) &buffer[nb*nblock + (long)(y-y0)*f.nx]);
+			if(status==FAIL) {
+				if(iprint > 0) printf("Cannot write data with SDwritedata\n");
+				return -1;
+			}
+			nwritten += y1-y;
+		}
+		nb++;
 	}
+	return nwritten;
+}
 
-	if(iprint > 0) printf("modis_readwrite done \n");
-	return nb;
-};
+// Rows of block k of pipe p.
+static void
+pipe_rows(ModisPipe &p, int k, int *y0, int *nrows)
+{
+	*y0 = k*p.blockrows;
+	*nrows = MIN(p.blockrows, p.f->ny - *y0);
+}
 
-int
-readlatitude(float ** buffer, int *nx, int *ny, const char *filename)
+// I/O thread of a ModisPipe. Writing the filled blocks comes first, so
+// that the compute threads get their output buffers back; otherwise the
+// thread reads up to PIPE_DEPTH blocks ahead of the released ones.
+static void *
+pipe_thread(void *arg)
 {
-	int32 sd_id, sds_index, sds_id; /* SD interface and data set identifiers */
-	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
-	int i, iprint = 1;
-	const char *sds_name = "Latitude";
-	
-	// open file for read
-	sd_id = SDstart(filename, DFACC_READ);
-	if(sd_id==FAIL) {
-		if(iprint > 0) printf("Cannot open file %s with SDstart\n", filename);
-		return -1;
+	ModisPipe &p = *(ModisPipe *)arg;
+	int k, y0, nrows, status;
+	double t0;
+
+	pthread_mutex_lock(&p.mu);
+	for(;;) {
+		if(p.status==0 && p.nwritten < p.nfilled) {
+			k = p.nwritten;
+			pipe_rows(p, k, &y0, &nrows);
+			pthread_mutex_unlock(&p.mu);
+			t0 = nowsec();
+			long nrowswritten = (long)p.f->nreadwrite*nrows;
+			if(p.changed != NULL) {
+				status = nrowswritten = modis_changedrows(*p.f, p.out[k%PIPE_DEPTH].ptr<unsigned short>(0),
+					y0, nrows, *p.changed);
+			} else {
+				status = modis_rows(*p.f, p.out[k%PIPE_DEPTH].ptr<unsigned short>(0), y0, nrows, 1);
+			}
+			pthread_mutex_lock(&p.mu);
+			p.writesec += nowsec() - t0;
+			if(status>=0) p.nbyteswritten += nrowswritten*p.f->nx*sizeof(unsigned short);
+			p.nwritten++;
+		} else if(p.status==0 && !p.stop && p.nread < p.nblock && p.nread < p.nused + PIPE_DEPTH) {
+			k = p.nread;
+			pipe_rows(p, k, &y0, &nrows);
+			pthread_mutex_unlock(&p.mu);
+			t0 = nowsec();
+			status = modis_rows(*p.f, p.in[k%PIPE_DEPTH].ptr<unsigned short>(0), y0, nrows, 0);
+			pthread_mutex_lock(&p.mu);
+			p.readsec += nowsec() - t0;
+			p.nbytesread += (long)p.f->nreadwrite*nrows*p.f->nx*sizeof(unsigned short);
+			p.nread++;
+		} else if(p.stop || p.status!=0) {
+			break;
+		} else {
+			pthread_cond_wait(&p.cond, &p.mu);
+			continue;
+		}
+		if(status<0 && p.status==0) p.status = status;
+		pthread_cond_broadcast(&p.cond);
 	}
+	pthread_cond_broadcast(&p.cond);
+	pthread_mutex_unlock(&p.mu);
+	return NULL;
+}
 
-	// find the index of data record
-	sds_index = SDnametoindex(sd_id, sds_name);
-	if(sds_index==FAIL) {
-		if(iprint > 0) printf("Cannot get index of %s with SDnametoindex\n", sds_name);
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine starts reading data record f in blocks of blockrows rows on a separate I/O thread.
+// Block k is taken with pipe_read and released with pipe_release in order. If write is true, the
+// resampled block k is put into the buffer returned by pipe_outbuf and handed back with pipe_filled,
+// also in order, and the I/O thread writes it back. The bands of block k are stored one after another
+// as for modis_rows. Since a block is only written after it has been read, reading and writing the
+// same rows is safe as long as block k is filled after block k has been taken. The buffers are allocated
+// from the arena a unless a is NULL. To only write the rows that changed, point p.changed to an image as
+// for modis_changedrows after this; it must be set for the rows of block k before block k is filled.
+//
+// Return value:
+// Upon sucessful completion, returns 0; negative return value indicates error. A started pipe must
+// be finished with pipe_finish. The time spent reading, writing and waiting for the I/O thread and the
+// bytes read and written are counted in p.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int pipe_start(ModisPipe &p, ModisField &f, int blockrows, bool write, Arena *a)
+{
+	int i;
+
+	p.f = &f;
+	p.blockrows = blockrows;
+	p.nblock = (f.ny + blockrows - 1)/blockrows;
+	p.write = write;
+	p.changed = NULL;
+	for(i=0; i<PIPE_DEPTH; i++) {
+		arena_mat(a, p.in[i], f.nreadwrite, blockrows*f.nx, CV_16UC1);
+		if(write) arena_mat(a, p.out[i], f.nreadwrite, blockrows*f.nx, CV_16UC1);
+	}
+	p.nread = p.nused = 0;
+	p.nfilled = p.nwritten = 0;
+	p.stop = false;
+	p.status = 0;
+	p.readsec = p.writesec = p.waitsec = 0;
+	p.nbytesread = p.nbyteswritten = 0;
+	pthread_mutex_init(&p.mu, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	if(pthread_create(&p.thread, NULL, pipe_thread, &p) != 0) {
+		printf("ERROR: Cannot start I/O thread\n");
+		pthread_mutex_destroy(&p.mu);
+		pthread_cond_destroy(&p.cond);
 		return -1;
 	}
+	return 0;
+}
+
+// Returns block k of pipe p once it has been read, or NULL on error.
+unsigned short *
+pipe_read(ModisPipe &p, int k)
+{
+	double t0 = nowsec();
+	pthread_mutex_lock(&p.mu);
+	while(p.nread <= k && p.status == 0)
+		pthread_cond_wait(&p.cond, &p.mu);
+	int status = p.status;
+	p.waitsec += nowsec() - t0;
+	pthread_mutex_unlock(&p.mu);
+	if(status != 0) return NULL;
+	return p.in[k%PIPE_DEPTH].ptr<unsigned short>(0);
+}
 
+// Releases the oldest block taken with pipe_read, so that its buffer
+// can be reused for reading ahead.
+void
+pipe_release(ModisPipe &p)
+{
+	pthread_mutex_lock(&p.mu);
+	p.nused++;
+	pthread_cond_broadcast(&p.cond);
+	pthread_mutex_unlock(&p.mu);
+}
 
+// Returns the buffer for resampled block k of pipe p once the block
+// that used it before has been written, or NULL on error.
+unsigned short *
+pipe_outbuf(ModisPipe &p, int k)
+{
+	double t0 = nowsec();
+	pthread_mutex_lock(&p.mu);
+	while(k - p.nwritten >= PIPE_DEPTH && p.status == 0)
+		pthread_cond_wait(&p.cond, &p.mu);
+	int status = p.status;
+	p.waitsec += nowsec() - t0;
+	pthread_mutex_unlock(&p.mu);
+	if(status != 0) return NULL;
+	return p.out[k%PIPE_DEPTH].ptr<unsigned short>(0);
+}
+
+// Hands the next resampled block of pipe p to the I/O thread for writing.
+void
+pipe_filled(ModisPipe &p)
+{
+	pthread_mutex_lock(&p.mu);
+	p.nfilled++;
+	pthread_cond_broadcast(&p.cond);
+	pthread_mutex_unlock(&p.mu);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// This subroutine waits until the I/O thread of pipe p has written all the filled blocks and stops it.
+//
+// Return value:
+// Upon sucessful completion, returns 0; negative return value indicates a read or write error.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+int pipe_finish(ModisPipe &p)
+{
+	pthread_mutex_lock(&p.mu);
+	p.stop = true;
+	pthread_cond_broadcast(&p.cond);
+	pthread_mutex_unlock(&p.mu);
+	pthread_join(p.thread, NULL);
+	pthread_mutex_destroy(&p.mu);
+	pthread_cond_destroy(&p.cond);
+	return p.status;
+}
+
+int
+readlatitude(float ** buffer, int *nx, int *ny, HdfFile &h)
+{
+	AutoLock lock(hdflock);
+	int32 sds_id; /* data set identifier */
+	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
+	int i, iprint = 1;
+	const char *sds_name = "Latitude";
+	
 	// open the data record
-	sds_id = SDselect(sd_id, sds_index);
+	sds_id = sdselect(h, sds_name);
 	if(sds_id==FAIL) {
-		if(iprint > 0) printf("Cannot select data set with SDselect\n");
+		if(iprint > 0) printf("Cannot select data set %s\n", sds_name);
 		return -1;
 	}
 
@@ -338,49 +740,24 @@ readlatitude(float ** buffer, int *nx, int *ny, const char *filename)
 			return -1;
 	}
 
-	// close data record
-	status = SDendaccess(sds_id);
-	if(status==FAIL) {
-		if(iprint > 0) printf("Cannot end access with SDendaccess\n");
-		return -1;
-	}
-	
-	// close hdf4 file access
-	status = SDend(sd_id);
-	if(status==FAIL) {
-		if(iprint > 0) printf("Cannot end with SDend\n");
-		return -1;
-	}
 	return ntot;
 }
 
 int
-writelatitude(const Mat &lat, const char *filename)
+writelatitude(const Mat &lat, HdfFile &h)
 {
-	int32 sd_id, sds_index, sds_id; /* SD interface and data set identifiers */
+	AutoLock lock(hdflock);
+	int32 sds_id; /* data set identifier */
 	intn status; /* status returned by some routines; has value SUCCEED or FAIL */
 	int i, iprint = 1;
 	const char *sds_name = "Latitude";
 	
 	CHECKMAT(lat, CV_32FC1);
 	
-	sd_id = SDstart(filename, DFACC_WRITE);
-	if(sd_id==FAIL) {
-		if(iprint > 0) printf("Cannot open file %s with SDstart\n", filename);
-		return -1;
-	}
-
-	// find the index of data record
-	sds_index = SDnametoindex(sd_id, sds_name);
-	if(sds_index==FAIL) {
-		if(iprint > 0) printf("Cannot get index of %s with SDnametoindex\n", sds_name);
-		return -1;
-	}
-
 	// open the data record
-	sds_id = SDselect(sd_id, sds_index);
+	sds_id = sdselect(h, sds_name);
 	if(sds_id==FAIL) {
-		if(iprint > 0) printf("Cannot select data set with SDselect\n");
+		if(iprint > 0) printf("Cannot select data set %s\n", sds_name);
 		return -1;
 	}
 
@@ -456,18 +833,5 @@ writelatitude(const Mat &lat, const char *filename)
 		}
 	}
 
-	// close data record
-	status = SDendaccess(sds_id);
-	if(status==FAIL) {
-		if(iprint > 0) printf("Cannot end access with SDendaccess\n");
-		return -1;
-	}
-	
-	// close hdf4 file access
-	status = SDend(sd_id);
-	if(status==FAIL) {
-		if(iprint > 0) printf("Cannot end with SDend\n");
-		return -1;
-	}
 	return 0;
 }
@@ -5,7 +5,14 @@
 #include "modisresam.h"
 #include "sort.h"
 
-#define SIGN(A)   ((A) > 0 ? 1 : ((A) < 0 ? -1 : 0 ))
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
 
 // b in between a and c
 #define INBETWEEN(a, b, c) (((a) <= (b) && (b) <= (c)) || ((c) <= (b) && (b) <= (a)))
@@ -13,6 +20,20 @@
 enum {
 	WIDTH_1KM = 1354,
 	DEBUG = false,
+	RING_IN = 4,		// input swaths kept by a SwathStream
+	RING_TOUCH = 7,		// input swaths kept by a SwathStream with a touch list, STREAM_LAG on each side of an output swath
+	RING_SORT = 3,		// sorted and resampled swaths kept by a SwathStream
+	STREAM_LAG = 3,		// swaths between input and output of a SwathStream
+};
+
+// Columns of the overlapping regions at the edges of each swath.
+enum {
+	C0 = 0,
+	C1 = 70,
+	C2 = 70+130,
+	C3 = WIDTH_1KM - C2,
+	C4 = WIDTH_1KM - C1,
+	C5 = WIDTH_1KM,
 };
 
 // Generate a image of latitude sorting indices.
@@ -45,280 +66,795 @@ getsortingind(Mat &sind, int swaths)
 	}
 }
 
-template <class T>
-static Mat
-resample_unsort_(const Mat &sind, const Mat &img)
+// Returns the comparators of a sorting network for n <= 32 elements.
+// This is Batcher's odd-even merge sort for 32 elements without the
+// comparators that touch elements n and above: those would only hold
+// +infinity, which the other comparators never move.
+//
+// net -- comparators, element net[k][0] < net[k][1] (output)
+//
+static int
+getsortnet(int net[][2], int n)
 {
-	Mat newimg;
-	int i, j, k;
-	int32_t *sp;
-	T *ip;
+	int N = 32, m = 0;
 
-	CHECKMAT(sind, CV_32SC1);
-	CV_Assert(img.channels() == 1);
+	CV_Assert(n <= N);
+	for(int p = 1; p < N; p <<= 1){
+		for(int k = p; k >= 1; k >>= 1){
+			for(int j = k % p; j + k < N; j += 2*k){
+				for(int i = 0; i < k && i + j + k < n; i++){
+					if((i + j)/(2*p) == (i + j + k)/(2*p)){
+						net[m][0] = i + j;
+						net[m][1] = i + j + k;
+						m++;
+					}
+				}
+			}
+		}
+	}
+	return m;
+}
+
+// The latitude of a column is sorted in windows of two swaths that
+// step by one swath: after sorting rows w..w+2*SWATH_SIZE-1, the first
+// swath of the window is final and the second swath is sorted again
+// with the next one. This sorts a column exactly as long as no row is
+// more than a swath away from its sorted row. Each window is sorted in
+// the direction in which the latitude of the column changes along the
+// track there, with ties kept in the original order, and the direction,
+// 1 or -1, is stored in row w/SWATH_SIZE of dir.
+//
+// The vector version below sorts 8 columns at a time, one in each lane,
+// with the same comparators as the scalar version, so they give the
+// same result. It returns the number of columns done.
+
+#ifdef HAVE_AVX2
+
+__attribute__((target("avx2")))
+static int
+latsortcols_avx2(const Mat &lat, Mat &sind, Mat &dir, int net[][2], int nnet, int nw)
+{
+	int height = lat.rows, width = lat.cols;
+	__m256 key[2*SWATH_SIZE];
+	__m256i idx[2*SWATH_SIZE];
+	const __m256 one = _mm256_set1_ps(1), minusone = _mm256_set1_ps(-1);
+	int x;
 
-	newimg = Mat::zeros(img.rows, img.cols, img.type());
-	sp = (int32_t*)sind.data;
-	ip = (T*)img.data;
-	k = 0;
-	for(i = 0; i < newimg.rows; i++) {
-		for(j = 0; j < newimg.cols; j++) {
-			newimg.at<T>(sp[k], j) = ip[k];
-			k++;
+	for(x = 0; x+8 <= width; x += 8){
+		for(int r = 0; r < nw; r++){
+			key[r] = _mm256_loadu_ps(lat.ptr<float>(r) + x);
+			idx[r] = _mm256_set1_epi32(r);
+		}
+		for(int w = 0; ; w += SWATH_SIZE){
+			__m256 d = _mm256_blendv_ps(one, minusone,
+				_mm256_cmp_ps(key[nw-1-nw/4], key[nw/4], _CMP_LT_OQ));
+			_mm256_storeu_ps(dir.ptr<float>(w/SWATH_SIZE) + x, d);
+			for(int r = 0; r < nw; r++)
+				key[r] = _mm256_mul_ps(key[r], d);
+			for(int k = 0; k < nnet; k++){
+				int a = net[k][0], b = net[k][1];
+				__m256 gt = _mm256_or_ps(_mm256_cmp_ps(key[a], key[b], _CMP_GT_OQ),
+					_mm256_and_ps(_mm256_cmp_ps(key[a], key[b], _CMP_EQ_OQ),
+					_mm256_castsi256_ps(_mm256_cmpgt_epi32(idx[a], idx[b]))));
+				__m256 ka = key[a];
+				__m256i ia = idx[a];
+				key[a] = _mm256_blendv_ps(ka, key[b], gt);
+				key[b] = _mm256_blendv_ps(key[b], ka, gt);
+				idx[a] = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(ia),
+					_mm256_castsi256_ps(idx[b]), gt));
+				idx[b] = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(idx[b]),
+					_mm256_castsi256_ps(ia), gt));
+			}
+			for(int r = 0; r < nw; r++)
+				key[r] = _mm256_mul_ps(key[r], d);
+
+			int nfinal = w + nw >= height ? nw : SWATH_SIZE;
+			for(int r = 0; r < nfinal; r++)
+				_mm256_storeu_si256((__m256i*)(sind.ptr<int>(w+r) + x), idx[r]);
+			if(nfinal == nw)
+				break;
+			for(int r = 0; r < SWATH_SIZE; r++){
+				key[r] = key[r+SWATH_SIZE];
+				idx[r] = idx[r+SWATH_SIZE];
+				key[r+SWATH_SIZE] = _mm256_loadu_ps(lat.ptr<float>(w+nw+r) + x);
+				idx[r+SWATH_SIZE] = _mm256_set1_epi32(w+nw+r);
+			}
 		}
 	}
-	return newimg;
+	return x;
 }
 
-// Returns the unsorted image of the sorted image img.
-// Sind is the image of sort indices.
-static Mat
-resample_unsort(const Mat &sind, const Mat &img)
+#endif // HAVE_AVX2
+
+// Sorts columns x0.. of lat into sind.
+static void
+latsortcols(const Mat &lat, Mat &sind, Mat &dir, int net[][2], int nnet, int nw, int x0)
 {
-	switch(img.type()) {
-	default:
-		eprintf("unsupported type %s\n", type2str(img.type()));
-		break;
-	case CV_8UC1:
-		return resample_unsort_<uchar>(sind, img);
-		break;
-	case CV_32FC1:
-		return resample_unsort_<float>(sind, img);
-		break;
-	case CV_64FC1:
-		return resample_unsort_<double>(sind, img);
-		break;
+	int height = lat.rows;
+	float key[2*SWATH_SIZE];
+	int idx[2*SWATH_SIZE];
+
+	for(int x = x0; x < lat.cols; x++){
+		for(int r = 0; r < nw; r++){
+			key[r] = lat.at<float>(r, x);
+			idx[r] = r;
+		}
+		for(int w = 0; ; w += SWATH_SIZE){
+			float d = key[nw-1-nw/4] < key[nw/4] ? -1 : 1;
+			dir.at<float>(w/SWATH_SIZE, x) = d;
+			for(int r = 0; r < nw; r++)
+				key[r] *= d;
+			for(int k = 0; k < nnet; k++){
+				int a = net[k][0], b = net[k][1];
+				if(key[a] > key[b] || (key[a] == key[b] && idx[a] > idx[b])){
+					std::swap(key[a], key[b]);
+					std::swap(idx[a], idx[b]);
+				}
+			}
+			for(int r = 0; r < nw; r++)
+				key[r] *= d;
+
+			int nfinal = w + nw >= height ? nw : SWATH_SIZE;
+			for(int r = 0; r < nfinal; r++)
+				sind.at<int>(w+r, x) = idx[r];
+			if(nfinal == nw)
+				break;
+			for(int r = 0; r < SWATH_SIZE; r++){
+				key[r] = key[r+SWATH_SIZE];
+				idx[r] = idx[r+SWATH_SIZE];
+				key[r+SWATH_SIZE] = lat.at<float>(w+nw+r, x);
+				idx[r+SWATH_SIZE] = w+nw+r;
+			}
+		}
 	}
-	// not reached
-	return Mat();
 }
 
-template <class T>
-static Mat
-resample_sort_(const Mat &sind, const Mat &img)
+// Generate an image of latitude sorting indices from the latitude of
+// the granule itself instead of the sorting indices of a sample
+// granule in sort.h. Columns with latitudes that are not valid, in
+// which sorting would move a row by more than a swath, or which the
+// windows of latsortcols leave unsorted, keep the indices of
+// getsortingind.
+//
+// sind -- sorting indices (output)
+// lat -- latitude
+//
+void
+getlatsortingind(Mat &sind, const Mat &lat)
 {
-	Mat newimg;
-	int i, j, k;
-	int32_t *sp;
-	T *np;
+	int net[256][2], nnet, nw, x = 0;
+	Mat lsind, dir;
+
+	CHECKMAT(lat, CV_32FC1);
+	getsortingind(sind, lat.rows/SWATH_SIZE);
+	CV_Assert(lat.rows == sind.rows && lat.cols == sind.cols);
+
+	nw = MIN(2*SWATH_SIZE, lat.rows);
+	nnet = getsortnet(net, nw);
+	lsind.create(lat.rows, lat.cols, CV_32SC1);
+	dir.create(lat.rows/SWATH_SIZE, lat.cols, CV_32FC1);
+#ifdef HAVE_AVX2
+	if(haveavx2())
+		x = latsortcols_avx2(lat, lsind, dir, net, nnet, nw);
+#endif
+	latsortcols(lat, lsind, dir, net, nnet, nw, x);
+
+	Mat bad = Mat::zeros(1, lat.cols, CV_8UC1);
+	uchar *bp = bad.ptr<uchar>(0);
+	for(int y = 0; y < lat.rows; y++){
+		const float *lp = lat.ptr<float>(y);
+		const int *lsp = lsind.ptr<int>(y);
+		for(x = 0; x < lat.cols; x++){
+			if(!(-90 <= lp[x] && lp[x] <= 90 && abs(lsp[x] - y) <= SWATH_SIZE))
+				bp[x] = 1;
+		}
+	}
+
+	// A row that had to move by more than a swath is left out of
+	// order even if no row moved by more than a swath. Rows y and y+1
+	// were last sorted together by the window that made row y final,
+	// so they must be in the order of that window.
+	for(int y = 0; y+1 < lat.rows; y++){
+		const float *dp = dir.ptr<float>(MIN(y, lat.rows-nw)/SWATH_SIZE);
+		const int *lsp = lsind.ptr<int>(y), *lsnext = lsind.ptr<int>(y+1);
+		for(x = 0; x < lat.cols; x++){
+			if(dp[x]*lat.at<float>(lsp[x], x) > dp[x]*lat.at<float>(lsnext[x], x))
+				bp[x] = 1;
+		}
+	}
+	for(int y = 0; y < lat.rows; y++){
+		const int *lsp = lsind.ptr<int>(y);
+		int *sp = sind.ptr<int>(y);
+		for(x = 0; x < lat.cols; x++){
+			if(!bp[x])
+				sp[x] = lsp[x];
+		}
+	}
+}
+
+// Store the permutation of the rows in each column given by the image
+// of indices ind as segments seg and their offsets off (see SortIndex).
+static void
+getsegments(const Mat &ind, Mat &seg, Mat &off)
+{
+	int i, x, n;
+	const int *ip;
+
+	CHECKMAT(ind, CV_32SC1);
+
+	off.create(ind.rows+1, 1, CV_32SC1);
+	n = 0;
+	for(i = 0; i < ind.rows; i++){
+		ip = ind.ptr<int>(i);
+		off.at<int>(i, 0) = n;
+		for(x = 0; x < ind.cols; x++){
+			if(x == 0 || ip[x] != ip[x-1])
+				n++;
+		}
+	}
+	off.at<int>(ind.rows, 0) = n;
+
+	seg.create(MAX(n, 1), 3, CV_32SC1);
+	n = 0;
+	for(i = 0; i < ind.rows; i++){
+		ip = ind.ptr<int>(i);
+		for(x = 0; x < ind.cols; x++){
+			if(x == 0 || ip[x] != ip[x-1]){
+				int *sp = seg.ptr<int>(n++);
+				sp[0] = x;
+				sp[2] = ip[x];
+			}
+			seg.at<int>(n-1, 1) = x+1;
+		}
+	}
+}
+
+// Initialize the segments of si from the image of sorting indices sind.
+// The image is only needed here: sorting and unsorting copy whole
+// segments.
+//
+void
+sortind_init(SortIndex &si, const Mat &sind)
+{
+	Mat uind;
 
 	CHECKMAT(sind, CV_32SC1);
-	CV_Assert(img.channels() == 1);
 
-	newimg = Mat::zeros(img.rows, img.cols, img.type());
-	sp = (int*)sind.data;
-	np = (T*)newimg.data;
-	k = 0;
-	for(i = 0; i < newimg.rows; i++){
-		for(j = 0; j < newimg.cols; j++){
-			np[k] = img.at<T>(sp[k], j);
-			k++;
+	si.rows = sind.rows;
+	si.cols = sind.cols;
+	si.maxdisp = 0;
+	uind.create(sind.rows, sind.cols, CV_32SC1);
+	for(int i = 0; i < sind.rows; i++) {
+		const int *sp = sind.ptr<int>(i);
+		for(int j = 0; j < sind.cols; j++) {
+			uind.at<int>(sp[j], j) = i;
+			if(abs(sp[j] - i) > si.maxdisp)
+				si.maxdisp = abs(sp[j] - i);
 		}
 	}
-	return newimg;
+	getsegments(sind, si.seg, si.off);
+	getsegments(uind, si.useg, si.uoff);
 }
 
-// Returns the sorted image of the unsorted image img.
-// Sind is the image of sort indices.
-Mat
-resample_sort(const Mat &sind, const Mat &img)
+// Expand the sorting indices of sorted row i of si into row.
+static void
+sortind_row(const SortIndex &si, int i, int *row)
+{
+	for(int k = si.off.at<int>(i, 0); k < si.off.at<int>(i+1, 0); k++){
+		const int *sp = si.seg.ptr<int>(k);
+		for(int x = sp[0]; x < sp[1]; x++)
+			row[x] = sp[2];
+	}
+}
+
+// Images of several bands are stored interleaved by line: row y of
+// band b occupies columns b*width .. (b+1)*width-1 of row y, where
+// width is the width of the sorting indices. Sorting and unsorting
+// both gather each row of the new image from segments of rows of the
+// old image, and they move the same segment of every band. Rows of
+// the new image are independent, so they are split across threads.
+
+template <class T>
+class PermuteBody : public ParallelLoopBody {
+	const Mat &seg, &off, &img;
+	int width;
+	Mat &newimg;
+public:
+	PermuteBody(const Mat &_seg, const Mat &_off, int _width, const Mat &_img, Mat &_newimg)
+		: seg(_seg), off(_off), img(_img), width(_width), newimg(_newimg) {}
+
+	void operator()(const Range &rows) const {
+		int i, k, b, nband;
+		const int *sp;
+		const T *ip;
+		T *np;
+
+		nband = img.cols / width;
+		for(i = rows.start; i < rows.end; i++){
+			np = newimg.ptr<T>(i);
+			for(k = off.at<int>(i, 0); k < off.at<int>(i+1, 0); k++){
+				sp = seg.ptr<int>(k);
+				ip = img.ptr<T>(sp[2]);
+				for(b = 0; b < nband; b++){
+					memcpy(&np[b*width + sp[0]], &ip[b*width + sp[0]],
+						(sp[1] - sp[0])*sizeof(T));
+				}
+			}
+		}
+	}
+};
+
+template <class T>
+static void
+resample_permute_(const Mat &seg, const Mat &off, int width, const Mat &img, Mat &newimg)
+{
+	CV_Assert(img.isContinuous() && img.channels() == 1);
+	CV_Assert(img.rows == off.rows-1 && img.cols % width == 0);
+	CV_Assert(img.data != newimg.data);
+
+	// every element of newimg is written below
+	newimg.create(img.rows, img.cols, img.type());
+	parallel_for_(Range(0, img.rows), PermuteBody<T>(seg, off, width, img, newimg));
+}
+
+// Permute the rows of each column of img into newimg as given by the
+// segments seg with offsets off.
+static void
+resample_permute(const Mat &seg, const Mat &off, int width, const Mat &img, Mat &newimg)
 {
-	switch(img.type()){
+	switch(img.depth()){
 	default:
 		eprintf("unsupported type %s\n", type2str(img.type()));
 		break;
-	case CV_8UC1:
-		return resample_sort_<uchar>(sind, img);
+	case CV_8U:
+		resample_permute_<uchar>(seg, off, width, img, newimg);
 		break;
-	case CV_32FC1:
-		return resample_sort_<float>(sind, img);
+	case CV_32F:
+		resample_permute_<float>(seg, off, width, img, newimg);
 		break;
-	case CV_64FC1:
-		return resample_sort_<double>(sind, img);
+	case CV_64F:
+		resample_permute_<double>(seg, off, width, img, newimg);
 		break;
 	}
-	// not reached
-	return Mat();
 }
 
-// Returns the average of 2 values which can be NAN.
-static double
-avg2(double a, double b)
+// Unsort the sorted image img into newimg.
+// Si are the sorting indices.
+void
+resample_unsort(const SortIndex &si, const Mat &img, Mat &newimg)
 {
-        if(isnan(a))
-                return b;
-        if(isnan(b))
-                return a;
-        return (a+b) / 2.0;
+	resample_permute(si.useg, si.uoff, si.cols, img, newimg);
 }
 
-// Resample 1D data.
+// Sort the unsorted image img into newimg, reusing newimg's buffer
+// if it already has the right size and type.
+// Si are the sorting indices.
+void
+resample_sort(const SortIndex &si, const Mat &img, Mat &newimg)
+{
+	resample_permute(si.seg, si.off, si.cols, img, newimg);
+}
+
+// Returns the sorted image of the unsorted image img.
+// Si are the sorting indices.
+Mat
+resample_sort(const SortIndex &si, const Mat &img)
+{
+	Mat newimg;
+
+	resample_sort(si, img, newimg);
+	return newimg;
+}
+
+// Compute the interpolation weights of the sorted latitude slat.
+// Pixel i of a column is interpolated between the average with
+// pixel i-1 (weight 1-lam) and the average with pixel i+1
+// (weight lam). The weights only depend on the latitude, so they
+// are computed once per granule in double precision.
 //
-// sind -- sorting indices
 // slat -- sorted latitude
-// sval -- sorted values
-// dir -- diff direction (-1 or 1)
-// rval -- resampled values (intput & output)
+// lam -- interpolation weights (output)
 //
 static void
-resample1d(const int *sind, const float *slat, const float *sval, int n, int stride, float *rval)
+getweights(const Mat &slat, Mat &lam)
 {
-	int i;
-	
-	// copy first non-nan value for first row
-	for(i = 0; i < n-stride; i += stride){
-		if(!isnan(sval[i])){
-			rval[0] = sval[i];
-			break;
+	int i, j;
+	const float *sp, *sl, *sn;
+	float *lp;
+
+	CHECKMAT(slat, CV_32FC1);
+
+	lam.create(slat.rows, slat.cols, CV_32FC1);
+	lam = Scalar(0.5);	// first and last rows are not interpolated
+	for(i = 1; i < slat.rows-1; i++){
+		sp = slat.ptr<float>(i-1);
+		sl = slat.ptr<float>(i);
+		sn = slat.ptr<float>(i+1);
+		lp = lam.ptr<float>(i);
+		for(j = 0; j < slat.cols; j++){
+			double x1 = (sl[j] + sp[j]) / 2;
+			double x2 = (sl[j] + sn[j]) / 2;
+			if(x2 == x1 || !INBETWEEN(x1, sl[j], x2)){
+				// slat[i] might not be in between x1 and x2 because we're
+				// using universal sorting indices; use the plain average
+				lp[j] = 0.5;
+			}else{
+				lp[j] = (sl[j] - x1) / (x2 - x1);
+			}
 		}
 	}
-	
-	// interpolate the middle values
-	for(i = stride; i < n-stride; i += stride){
-		if(SIGN(sind[i+stride] - sind[i]) == 1 && !isnan(sval[i])){
-			rval[i] = sval[i];
-			continue;
-		}
-		if(isnan(sval[i]) && isnan(sval[i-stride]) && isnan(sval[i+stride])){
-			printf("unable to resample at row %d\n", i/stride);
-			rval[i] = NAN;
-			continue;
-		}
-		double x1 = (slat[i] + slat[i-stride]) / 2;
-		double y1 = avg2(sval[i], sval[i-stride]);
-		double x2 = (slat[i] + slat[i+stride]) / 2;
-		double y2 = avg2(sval[i], sval[i+stride]);
-		
-		if(isnan(y1)){
-			rval[i] = y2;
-		}else if(isnan(y2)){
-			rval[i] = y1;
-		}else if(x2 == x1 || !INBETWEEN(x1, slat[i], x2)){
-			// slat[i] might not be in between x1 and x2 because we're
-			// using universal sorting indices
-			rval[i] = (y1+y2) / 2;
-		}else{
-			double lam = (slat[i] - x1) / (x2 - x1);
-			rval[i] = (1-lam)*y1 + lam*y2;
-		}
+}
+
+// Resample one pixel of a sorted column.
+//
+// inc -- sort index increases from this row to the next
+// lam -- interpolation weight
+// p, s, n -- sorted values of the previous, this and the next row
+//
+// Returns NAN only if p, s and n are all NAN.
+//
+static inline float
+resamplepix(bool inc, float lam, float p, float s, float n)
+{
+	float y1, y2;
+
+	if(inc && !isnan(s))
+		return s;
+	y1 = isnan(s) ? p : (isnan(p) ? s : (s+p)*0.5f);
+	y2 = isnan(s) ? n : (isnan(n) ? s : (s+n)*0.5f);
+	if(isnan(y1))
+		return y2;
+	if(isnan(y2))
+		return y1;
+	return (1-lam)*y1 + lam*y2;
+}
+
+// The vector versions of resamplepix below compute exactly the same
+// float expression for every pixel, without branches: the NAN tests
+// become masks and the cases are merged with blends. They process
+// the first n - n%4 (SSE2) or n - n%8 (AVX2) pixels of a row and
+// return the number of pixels done.
+
+#ifdef HAVE_SSE2
+
+// Returns b where mask m is set, a elsewhere.
+static inline __m128
+blend4(__m128 a, __m128 b, __m128 m)
+{
+	return _mm_or_ps(_mm_and_ps(m, b), _mm_andnot_ps(m, a));
+}
+
+static int
+resamplerow_sse2(const int *si, const int *sinext, const float *lam,
+	const float *p, const float *s, const float *n, float *r, int len, int *nnan)
+{
+	const __m128 half = _mm_set1_ps(0.5f), one = _mm_set1_ps(1.0f);
+	int j;
+
+	for(j = 0; j+4 <= len; j += 4){
+		__m128 vp = _mm_loadu_ps(&p[j]);
+		__m128 vs = _mm_loadu_ps(&s[j]);
+		__m128 vn = _mm_loadu_ps(&n[j]);
+		__m128 vl = _mm_loadu_ps(&lam[j]);
+		__m128 inc = _mm_castsi128_ps(_mm_cmpgt_epi32(
+			_mm_loadu_si128((const __m128i*)&sinext[j]),
+			_mm_loadu_si128((const __m128i*)&si[j])));
+		__m128 snan = _mm_cmpunord_ps(vs, vs);
+		__m128 pnan = _mm_cmpunord_ps(vp, vp);
+		__m128 nnanm = _mm_cmpunord_ps(vn, vn);
+
+		__m128 y1 = blend4(blend4(_mm_mul_ps(_mm_add_ps(vs, vp), half), vs, pnan), vp, snan);
+		__m128 y2 = blend4(blend4(_mm_mul_ps(_mm_add_ps(vs, vn), half), vs, nnanm), vn, snan);
+		__m128 v = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(one, vl), y1), _mm_mul_ps(vl, y2));
+		v = blend4(v, y1, _mm_and_ps(snan, nnanm));
+		v = blend4(v, y2, _mm_and_ps(snan, pnan));
+		v = blend4(v, vs, _mm_andnot_ps(snan, inc));
+		_mm_storeu_ps(&r[j], v);
+		*nnan += __builtin_popcount(_mm_movemask_ps(_mm_cmpunord_ps(v, v)));
 	}
-	
-	// copy last non-nan value to last row
-	for(int k = i; k >= 0; k -= stride){
-		if(!isnan(sval[k])){
-			rval[i] = sval[k];
-			break;
-		}
+	return j;
+}
+
+#endif // HAVE_SSE2
+
+#ifdef HAVE_AVX2
+
+__attribute__((target("avx2")))
+static int
+resamplerow_avx2(const int *si, const int *sinext, const float *lam,
+	const float *p, const float *s, const float *n, float *r, int len, int *nnan)
+{
+	const __m256 half = _mm256_set1_ps(0.5f), one = _mm256_set1_ps(1.0f);
+	int j;
+
+	for(j = 0; j+8 <= len; j += 8){
+		__m256 vp = _mm256_loadu_ps(&p[j]);
+		__m256 vs = _mm256_loadu_ps(&s[j]);
+		__m256 vn = _mm256_loadu_ps(&n[j]);
+		__m256 vl = _mm256_loadu_ps(&lam[j]);
+		__m256 inc = _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+			_mm256_loadu_si256((const __m256i*)&sinext[j]),
+			_mm256_loadu_si256((const __m256i*)&si[j])));
+		__m256 snan = _mm256_cmp_ps(vs, vs, _CMP_UNORD_Q);
+		__m256 pnan = _mm256_cmp_ps(vp, vp, _CMP_UNORD_Q);
+		__m256 nnanm = _mm256_cmp_ps(vn, vn, _CMP_UNORD_Q);
+
+		__m256 y1 = _mm256_blendv_ps(_mm256_blendv_ps(
+			_mm256_mul_ps(_mm256_add_ps(vs, vp), half), vs, pnan), vp, snan);
+		__m256 y2 = _mm256_blendv_ps(_mm256_blendv_ps(
+			_mm256_mul_ps(_mm256_add_ps(vs, vn), half), vs, nnanm), vn, snan);
+		__m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(one, vl), y1),
+			_mm256_mul_ps(vl, y2));
+		v = _mm256_blendv_ps(v, y1, _mm256_and_ps(snan, nnanm));
+		v = _mm256_blendv_ps(v, y2, _mm256_and_ps(snan, pnan));
+		v = _mm256_blendv_ps(v, vs, _mm256_andnot_ps(snan, inc));
+		_mm256_storeu_ps(&r[j], v);
+		*nnan += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(v, v, _CMP_UNORD_Q)));
 	}
+	return j;
 }
 
+#endif // HAVE_AVX2
+
+// Resample one row of one band of a sorted image. This walks
+// whole rows instead of single columns, so all accesses are
+// sequential, and uses the widest vector unit available.
+//
+// The interpolation is done in single precision. Compared to
+// interpolating in double precision the result differs by at most
+// 4 ulp, so after conversion back to integers a pixel may differ by
+// 1 DN when its value lies right next to a rounding boundary.
+//
+// si, sinext -- sorting indices of this and the next row
+// lam -- interpolation weights of this row
+// p, s, n -- sorted values of the previous, this and the next row
+// r -- resampled values of this row (output)
+// len -- number of pixels in the row
+//
+// Returns the number of pixels that could not be resampled
+// because they and their neighbours are all NAN.
+//
+static int
+resamplerow(const int *si, const int *sinext, const float *lam,
+	const float *p, const float *s, const float *n, float *r, int len)
+{
+	int j = 0, nnan = 0;
+
+#ifdef HAVE_AVX2
+	if(haveavx2())
+		j = resamplerow_avx2(si, sinext, lam, p, s, n, r, len, &nnan);
+#endif
+#ifdef HAVE_SSE2
+	if(j == 0)
+		j = resamplerow_sse2(si, sinext, lam, p, s, n, r, len, &nnan);
+#endif
+	for(; j < len; j++){
+		r[j] = resamplepix(sinext[j] > si[j], lam[j], p[j], s[j], n[j]);
+		if(isnan(r[j]))
+			nnan++;
+	}
+	return nnan;
+}
+
+// Resamples a range of sorted rows other than the first and the
+// last. Rows are independent, so each thread gets its own range.
+class ResampleRowsBody : public ParallelLoopBody {
+	const Mat &ssrc, &lam;
+	const SortIndex &sortidx;
+	Mat &dst, &nnan;
+public:
+	ResampleRowsBody(const Mat &_ssrc, const Mat &_lam, const SortIndex &_sortidx, Mat &_dst, Mat &_nnan)
+		: ssrc(_ssrc), lam(_lam), sortidx(_sortidx), dst(_dst), nnan(_nnan) {}
+
+	void operator()(const Range &rows) const {
+		int width = sortidx.cols;
+		int nband = ssrc.cols / width;
+		Mat idx(2, width, CV_32SC1);
+		int *si = idx.ptr<int>(0), *sinext = idx.ptr<int>(1);
+
+		sortind_row(sortidx, rows.start, sinext);
+		for(int i = rows.start; i < rows.end; i++) {
+			std::swap(si, sinext);
+			sortind_row(sortidx, i+1, sinext);
+			nnan.at<int>(i, 0) = 0;
+			for(int b = 0; b < nband; b++) {
+				// the sort indices and weights of row i stay in
+				// cache while all the bands are resampled
+				nnan.at<int>(i, 0) += resamplerow(si, sinext,
+					lam.ptr<float>(i),
+					&ssrc.ptr<float>(i-1)[b*width],
+					&ssrc.ptr<float>(i)[b*width],
+					&ssrc.ptr<float>(i+1)[b*width],
+					&dst.ptr<float>(i)[b*width], width);
+			}
+		}
+	}
+};
 
 // Resample a 2D image.
 //
-// ssrc -- image to resample already sorted
-// slat -- sorted latitude
+// ssrc -- image to resample already sorted, may have several bands
+// lam -- interpolation weights
 // sortidx -- lat sorting indices
 // dst -- resampled image (output)
+//
+// Returns the number of pixels of all bands that could not be resampled.
 // 
-static void
-resample2d(const Mat &ssrc, const Mat &slat, const Mat &sortidx, Mat &dst)
+int
+resample2d(const Mat &ssrc, const Mat &lam, const SortIndex &sortidx, Mat &dst)
 {
-	int j, width, height;
-	Mat col, idx, botidx;
-	Range colrg, toprg, botrg;
+	int i, j, n, nn;
+	float v;
 
 	CHECKMAT(ssrc, CV_32FC1);
-	CHECKMAT(slat, CV_32FC1);
-	CHECKMAT(sortidx, CV_32SC1);
+	CHECKMAT(lam, CV_32FC1);
 	CV_Assert(ssrc.data != dst.data);
 
-	width = ssrc.cols;
-	height = ssrc.rows;
-	int total = ssrc.total();
-	dst = Mat::zeros(height, width, CV_32FC1);	// resampled values
+	n = ssrc.rows;
+	dst.create(n, ssrc.cols, CV_32FC1);	// resampled values
+
+	// interpolate the middle rows
+	Mat nnan(n, 1, CV_32SC1);
+	parallel_for_(Range(1, n-1), ResampleRowsBody(ssrc, lam, sortidx, dst, nnan));
+	nn = 0;
+	for(i = 1; i < n-1; i++){
+		nn += nnan.at<int>(i, 0);
+	}
+
+	for(j = 0; j < ssrc.cols; j++){
+		// copy first non-nan value for first row
+		v = 0;
+		for(i = 0; i < n-1; i++){
+			if(!isnan(ssrc.at<float>(i, j))){
+				v = ssrc.at<float>(i, j);
+				break;
+			}
+		}
+		dst.at<float>(0, j) = v;
 
-	for(j = 0; j < width; j++) {
-		// resample this column
-		resample1d(&sortidx.ptr<int>(0)[j],
-			&slat.ptr<float>(0)[j],
-			&ssrc.ptr<float>(0)[j],
-			total, width,
-			&dst.ptr<float>(0)[j]);
+		// copy last non-nan value to last row
+		v = 0;
+		for(i = n-1; i >= 0; i--){
+			if(!isnan(ssrc.at<float>(i, j))){
+				v = ssrc.at<float>(i, j);
+				break;
+			}
+		}
+		dst.at<float>(n-1, j) = v;
 	}
+	return nn;
 }
 
 
+// Set pixels x0 <= x < x1 of row y in all bands of dst to value.
+static void
+setrow(Mat &dst, int y, int x0, int x1, float value)
+{
+	float *p = dst.ptr<float>(y);
+
+	for(int b = 0; b < dst.cols; b += WIDTH_1KM) {
+		for(int x = x0; x < x1; x++) {
+			p[b + x] = value;
+		}
+	}
+}
+
 // Set overlapping regions to NAN.
 //
-static void
+void
 setoverlaps1km(Mat &dst, float value)
 {
-	enum {
-		WIDTH_1KM = 1354,
-		C0 = 0,
-		C1 = 70,
-		C2 = 70+130,
-		C3 = WIDTH_1KM - C2,
-		C4 = WIDTH_1KM - C1,
-		C5 = WIDTH_1KM,
-	};
-	
 	CHECKMAT(dst, CV_32FC1);
 	
-	if(dst.cols != WIDTH_1KM){
-		eprintf("width of image is not %d\n", WIDTH_1KM);
+	if(dst.cols % WIDTH_1KM != 0){
+		eprintf("width of image is not a multiple of %d\n", WIDTH_1KM);
 	}
 
 	for(int y = 0; y < dst.rows; y += SWATH_SIZE) {
-		for(int x = C0; x < C2; x++) {
-			dst.at<float>(y+0, x) = value;
-		}
-		for(int x = C0; x < C1; x++) {
-			dst.at<float>(y+1, x) = value;
-		}
-		for(int x = C0; x < C1; x++) {
-			dst.at<float>(y+8, x) = value;
-		}
-		for(int x = C0; x < C2; x++) {
-			dst.at<float>(y+9, x) = value;
-		}
+		setrow(dst, y+0, C0, C2, value);
+		setrow(dst, y+1, C0, C1, value);
+		setrow(dst, y+8, C0, C1, value);
+		setrow(dst, y+9, C0, C2, value);
 
-		for(int x = C3; x < C5; x++) {
-			dst.at<float>(y+0, x) = value;
-		}
-		for(int x = C4; x < C5; x++) {
-			dst.at<float>(y+1, x) = value;
-		}
-		for(int x = C4; x < C5; x++) {
-			dst.at<float>(y+8, x) = value;
+		setrow(dst, y+0, C3, C5, value);
+		setrow(dst, y+1, C4, C5, value);
+		setrow(dst, y+8, C4, C5, value);
+		setrow(dst, y+9, C3, C5, value);
+	}
+}
+
+// Whether pixel (y, x) lies in an overlapping region masked by
+// setoverlaps1km.
+static inline bool
+isoverlap(int y, int x)
+{
+	switch(y % SWATH_SIZE) {
+	case 0: case 9:
+		return x < C2 || x >= C3;
+	case 1: case 8:
+		return x < C1 || x >= C4;
+	}
+	return false;
+}
+
+// Set the pixels of sorted row i of s that lie in overlapping regions
+// to NAN. si are the sorting indices.
+//
+// Returns the number of pixels set to NAN.
+//
+static int
+setoverlaprow(const SortIndex &si, int i, float *s)
+{
+	int n = 0;
+
+	for(int k = si.off.at<int>(i, 0); k < si.off.at<int>(i+1, 0); k++) {
+		const int *sp = si.seg.ptr<int>(k);
+		for(int x = sp[0]; x < MIN(sp[1], C2); x++) {
+			if(isoverlap(sp[2], x)) {
+				s[x] = NAN;
+				n++;
+			}
 		}
-		for(int x = C3; x < C5; x++) {
-			dst.at<float>(y+9, x) = value;
+		for(int x = MAX(sp[0], C3); x < sp[1]; x++) {
+			if(isoverlap(sp[2], x)) {
+				s[x] = NAN;
+				n++;
+			}
 		}
 	}
+	return n;
 }
 
-// Resample VIIRS swatch image _img with corresponding
-// latitude image _lat.
-// _img[0..ny][0..nx]  - original image (brightness temperature)
-// _lat[0..ny][0..nx]  - original latitude
-// nx = width of image (should be 3200 for VIIRS)
-// ny = height of image ( 5408 or 5392 for ~10 min VIIRS granule)
+// Initialize resampling context r for the latitude image lat.
+// The sorting indices, the sorted latitude and the interpolation
+// weights only depend on the latitude, so they are computed here
+// once per granule instead of once per band. The latitude data is
+// not copied, so lat must outlive r. If latsort is true, the sorting
+// indices come from sorting lat itself instead of from sort.h.
 //
 void
-resample_modis(float **_img, float *_lat, int nx, int ny,
-	bool maskoverlap, bool sortoutput)
+resample_init(ResampleContext &r, const Mat &lat, bool latsort)
+{
+	CHECKMAT(lat, CV_32FC1);
+	if(lat.rows % SWATH_SIZE != 0){
+		eprintf("latitude height %d is not a multiple of %d", lat.rows, SWATH_SIZE);
+	}
+
+	Mat sind;
+
+	r.lat = lat;
+	if(latsort)
+		getlatsortingind(sind, lat);
+	else
+		getsortingind(sind, lat.rows/SWATH_SIZE);
+	sortind_init(r.sind, sind);
+	resample_sort(r.sind, r.lat, r.slat);
+	getweights(r.slat, r.lam);
+
+	if(DEBUG)dumpmat("lat.bin", r.lat);
+	if(DEBUG)dumpmat("sind.bin", sind);
+	if(DEBUG)dumpmat("slat.bin", r.slat);
+}
+
+// Resample the nband bands of MODIS swath image _img using the
+// resampling context r. The bands are interleaved by line, so the
+// sorting indices and interpolation weights of each row are only
+// looked up once for all bands.
+// _img[0..ny][0..nx*nband] - original image (reflectance or brightness temperature),
+//                            row y of band b starts at _img[y][b*nx];
+//                            resampled in-place
+//
+// Returns the number of pixels of all bands that could not be resampled.
+//
+int
+resample_bands(ResampleContext &r, float **_img, int nband, bool maskoverlap, bool sortoutput)
 {
-	Mat sind, dst;
-	
 	if(DEBUG) printf("resampling debugging is turned on!\n");
 	
 	// Mat wrapper around external buffer.
 	// Caller of this function still reponsible for freeing the buffers.
-	Mat img(ny, nx, CV_32FC1, &_img[0][0]);
-	Mat lat(ny, nx, CV_32FC1, _lat);
+	Mat img(r.lat.rows, r.lat.cols*nband, CV_32FC1, &_img[0][0]);
 	if(DEBUG)dumpmat("before.bin", img);
-	if(DEBUG)dumpmat("lat.bin", lat);
 	
 	if(maskoverlap){
 		// Set overlapping regions to NAN.
@@ -327,22 +863,819 @@ resample_modis(float **_img, float *_lat, int nx, int ny,
 		if(DEBUG)dumpmat("masked.bin", img);
 	}
 	
-	getsortingind(sind, lat.rows/SWATH_SIZE);
-	Mat slat = resample_sort(sind, lat);
-	Mat simg = resample_sort(sind, img);
-	if(DEBUG)dumpmat("sind.bin", sind);
-	if(DEBUG)dumpmat("simg.bin", simg);
-	if(DEBUG)dumpmat("slat.bin", slat);
+	resample_sort(r.sind, img, r.simg);
+	if(DEBUG)dumpmat("simg.bin", r.simg);
 	
-	resample2d(simg, slat, sind, dst);
-	if(DEBUG)dumpmat("after.bin", dst);
+	int nnan = resample2d(r.simg, r.lam, r.sind, r.dst);
+	if(DEBUG)dumpmat("after.bin", r.dst);
 
-	if(!sortoutput){
-		dst = resample_unsort(sind, dst);
+	if(sortoutput){
+		CV_Assert(r.dst.size() == img.size() && r.dst.type() == img.type());
+		r.dst.copyTo(img);
+	}else{
+		resample_unsort(r.sind, r.dst, img);
 	}
-		
-	CV_Assert(dst.size() == img.size() && dst.type() == img.type());
-	dst.copyTo(img);
-	if(DEBUG)dumpfloat("final.bin", &_img[0][0], nx*ny);
+	if(DEBUG)dumpfloat("final.bin", &_img[0][0], r.lat.rows*r.lat.cols*nband);
 	if(DEBUG)exit(3);
+	return nnan;
+}
+
+// Whether pixel (y, x) is masked when resampling with maskoverlap.
+static inline bool
+ismasked(bool maskoverlap, int y, int x)
+{
+	return maskoverlap && isoverlap(y, x);
+}
+
+// Set up t with the pixels that resampling with r changes, by output
+// row. A pixel keeps its value if it is not masked and the sorting
+// index increases from its sorted row to the next one, because
+// converting an integer to a physical value and back gives the same
+// integer; so does a pixel of the first or last sorted row that is not
+// masked. Any other pixel is stored with the rows of the previous and
+// next pixel of its sorted column and its interpolation weight, except
+// that a pixel of the first or last sorted row is stored with the row
+// of the first or last pixel of its sorted column that is not masked,
+// or -1 if there is none, and -1 for the next row.
+// Returns -1 if a pixel depends on rows more than STREAM_LAG swaths
+// away, which a SwathStream cannot resample, and 0 otherwise.
+//
+int
+touch_init(TouchList &t, const ResampleContext &r, bool maskoverlap)
+{
+	const SortIndex &si = r.sind;
+	int n = si.rows, width = si.cols;
+	Mat sind(n, width, CV_32SC1), fill;
+
+	if(maskoverlap && width != WIDTH_1KM){
+		eprintf("width of image is %d, not %d", width, WIDTH_1KM);
+	}
+	for(int i = 0; i < n; i++)
+		sortind_row(si, i, sind.ptr<int>(i));
+
+	// count the pixels of each row, then store them
+	t.maskoverlap = maskoverlap;
+	t.off = Mat::zeros(n+1, 1, CV_32SC1);
+	for(int pass = 0; pass < 2; pass++) {
+		for(int i = 0; i < n; i++) {
+			const int *cur = sind.ptr<int>(i);
+			for(int x = 0; x < width; x++) {
+				int y = cur[x], p, nx;
+				float lam = 0;
+				bool masked = ismasked(maskoverlap, y, x);
+				if(i == 0 || i == n-1) {
+					if(!masked)
+						continue;
+					p = nx = -1;
+					for(int j = 0; j < n-1; j++) {
+						int k = i == 0 ? j : n-1-j;
+						if(!ismasked(maskoverlap, sind.at<int>(k, x), x)) {
+							p = sind.at<int>(k, x);
+							break;
+						}
+					}
+				} else {
+					nx = sind.at<int>(i+1, x);
+					if(nx > y && !masked)
+						continue;
+					p = sind.at<int>(i-1, x);
+					lam = r.lam.at<float>(i, x);
+				}
+				// the stream keeps STREAM_LAG input swaths on each
+				// side of the output swath
+				if((p >= 0 && abs(p/SWATH_SIZE - y/SWATH_SIZE) > STREAM_LAG)
+				|| (nx >= 0 && abs(nx/SWATH_SIZE - y/SWATH_SIZE) > STREAM_LAG))
+					return -1;
+				if(pass == 0) {
+					t.off.at<int>(y+1, 0)++;
+					continue;
+				}
+				int k = fill.at<int>(y, 0)++;
+				int *tp = t.pix.ptr<int>(k);
+				tp[0] = x;
+				tp[1] = p;
+				tp[2] = nx;
+				t.lam.at<float>(k, 0) = lam;
+			}
+		}
+		if(pass == 0) {
+			for(int y = 0; y < n; y++)
+				t.off.at<int>(y+1, 0) += t.off.at<int>(y, 0);
+			t.pix.create(MAX(t.off.at<int>(n, 0), 1), 3, CV_32SC1);
+			t.lam.create(t.pix.rows, 1, CV_32FC1);
+			fill = t.off.clone();
+		}
+	}
+	return 0;
+}
+
+// A SwathStream resamples bands stored as scaled integers one swath at
+// a time. The sorting indices only move rows within a swath and its
+// neighbours, so a swath is sorted once the input swath after it has
+// arrived, resampled once the sorted swath after it is ready, and
+// unsorted once the resampled swath after it is ready. Each stage keeps
+// its swaths in a small ring: the inputs in a ring of RING_IN swaths,
+// or RING_TOUCH with a touch list, which also keeps the original
+// integers of the output swaths, and the sorted and resampled swaths
+// in rings of RING_SORT swaths. An output
+// swath is finished STREAM_LAG swaths after its input was pushed.
+//
+// Reflective bands are converted to reflectance by an affine map, and
+// hold no NAN unless the overlaps are masked, so they are sorted and
+// unsorted as integers and kept as integers between the stages, in the
+// first half of their rows of the float rings. The interpolation itself
+// is still done in float: the resampling converts a few hundred columns
+// at a time to reflectance and back with the same kernels as the other
+// bands, so the result is the same, but the reflectance never leaves
+// the cache.
+
+// Row y of band b in the ring m of nring swaths.
+template <class T>
+static inline T*
+ringrow(Mat &m, int nring, int nband, int b, int y)
+{
+	return m.ptr<T>((((y/SWATH_SIZE) % nring)*nband + b)*SWATH_SIZE + y%SWATH_SIZE);
+}
+
+static inline unsigned short*
+inrow(SwathStream &s, int b, int y)
+{
+	return ringrow<unsigned short>(s.in, s.ringin, s.nband, b, y);
+}
+
+static inline float*
+simgrow(SwathStream &s, int b, int y)
+{
+	return ringrow<float>(s.simg, RING_SORT, s.nband, b, y);
+}
+
+static inline float*
+dstrow(SwathStream &s, int b, int y)
+{
+	return ringrow<float>(s.dst, RING_SORT, s.nband, b, y);
+}
+
+static inline unsigned short*
+simgrow16(SwathStream &s, int b, int y)
+{
+	return (unsigned short*)simgrow(s, b, y);
+}
+
+static inline unsigned short*
+dstrow16(SwathStream &s, int b, int y)
+{
+	return (unsigned short*)dstrow(s, b, y);
+}
+
+// Whether band b of s is kept as integers between the stages.
+static inline bool
+intband(const SwathStream &s, int b)
+{
+	return !s.conv[b].emissive && !s.maskoverlap;
+}
+
+// Fills rows with the rows of band b of the swaths k-1, k and k+1 in
+// the ring accessed with ringrow, leaving out the rows outside the
+// granule. Returns rows shifted so that it can be indexed by row.
+template <class T>
+static const T**
+swathrows(SwathStream &s, const T **rows, T *(*ringrow)(SwathStream&, int, int), int b, int k)
+{
+	int y0 = (k-1)*SWATH_SIZE;
+
+	for(int i = 0; i < 3*SWATH_SIZE; i++) {
+		int y = y0 + i;
+		rows[i] = 0 <= y && y < s.r->sind.rows ? ringrow(s, b, y) : NULL;
+	}
+	return rows - y0;
+}
+
+// Converts, masks and sorts swath k of each band.
+class SortSwathBody : public ParallelLoopBody {
+	SwathStream &s;
+	int k;
+public:
+	SortSwathBody(SwathStream &_s, int _k) : s(_s), k(_k) {}
+
+	void operator()(const Range &bands) const {
+		const SortIndex &si = s.r->sind;
+		int width = si.cols;
+		unsigned short *rp = (unsigned short*)s.scratch.ptr<int>(bands.start);
+
+		for(int b = bands.start; b < bands.end; b++) {
+			// rows of the swaths k-1, k and k+1, where sorting may
+			// take the rows of swath k from
+			const unsigned short *in[3*SWATH_SIZE], **inp;
+			inp = swathrows(s, in, inrow, b, k);
+			for(int i = k*SWATH_SIZE; i < (k+1)*SWATH_SIZE; i++) {
+				double t0 = s.times ? nowsec() : 0;
+				unsigned short *sp16 = intband(s, b) ? simgrow16(s, b, i) : rp;
+				for(int j = si.off.at<int>(i, 0); j < si.off.at<int>(i+1, 0); j++) {
+					const int *sp = si.seg.ptr<int>(j);
+					memcpy(&sp16[sp[0]], &inp[sp[2]][sp[0]], (sp[1] - sp[0])*sizeof(*sp16));
+				}
+				if(intband(s, b)) {
+					if(s.times)
+						s.times[b].sec[ST_SORT] += nowsec() - t0;
+					continue;
+				}
+				double t1 = s.times ? nowsec() : 0;
+				convert_row(s.conv[b], rp, simgrow(s, b, i), width);
+				if(s.maskoverlap)
+					s.noverlap.at<int>(b, i) = setoverlaprow(si, i, simgrow(s, b, i));
+				if(s.times) {
+					s.times[b].sec[ST_SORT] += t1 - t0;
+					s.times[b].sec[ST_CONVERT] += nowsec() - t1;
+				}
+			}
+		}
+	}
+};
+
+// Resamples swath k of band b of s, which is kept as integers, through
+// chunks of the sorted rows converted to float and back. idx holds the
+// sorting indices of the rows of swath k and the row after it. The
+// bands hold no NAN, so the first and last rows keep their sorted
+// values.
+static void
+resampleswath16(SwathStream &s, int b, int k, const Mat &idx)
+{
+	enum { CHUNK = 256 };
+	const ResampleContext &r = *s.r;
+	const BandConv &c = s.conv[b];
+	int n = r.sind.rows;
+	int width = r.sind.cols;
+	int i0 = k*SWATH_SIZE;
+	float buf[4][CHUNK];
+	int nclamped[SWATH_SIZE], nnan[SWATH_SIZE];
+
+	memset(nclamped, 0, sizeof nclamped);
+	memset(nnan, 0, sizeof nnan);
+	for(int x0 = 0; x0 < width; x0 += CHUNK) {
+		int m = MIN(CHUNK, width - x0);
+
+		// reflectance of the rows i-1, i and i+1, each converted once
+		float *p = buf[0], *sv = buf[1], *nv = buf[2], *rv = buf[3];
+		if(i0 > 0)
+			convert_row(c, &simgrow16(s, b, i0-1)[x0], p, m);
+		convert_row(c, &simgrow16(s, b, i0)[x0], sv, m);
+		for(int i = i0; i < i0+SWATH_SIZE; i++) {
+			if(i+1 < n)
+				convert_row(c, &simgrow16(s, b, i+1)[x0], nv, m);
+			const float *res = sv;
+			if(i != 0 && i != n-1) {
+				nnan[i-i0] += resamplerow(&idx.ptr<int>(i-i0)[x0], &idx.ptr<int>(i-i0+1)[x0],
+					&r.lam.ptr<float>(i)[x0], p, sv, nv, rv, m);
+				res = rv;
+			}
+			nclamped[i-i0] += convert_row_back(c, res, &simgrow16(s, b, i)[x0],
+				&dstrow16(s, b, i)[x0], m);
+			float *t = p;
+			p = sv;
+			sv = nv;
+			nv = t;
+		}
+	}
+	for(int i = i0; i < i0+SWATH_SIZE; i++) {
+		if(i != 0 && i != n-1)
+			s.nnan.at<int>(b, i) = nnan[i-i0];
+		s.nclamped.at<int>(b, i) = nclamped[i-i0];
+	}
+}
+
+// Resamples swath k of each band. The first and last rows take the
+// first and last non-NAN value of their sorted column among the sorted
+// swaths in the ring. Only the overlapping pixels are NAN, and they
+// never fill a swath, so this is the same value as in the whole column.
+class ResampleSwathBody : public ParallelLoopBody {
+	SwathStream &s;
+	int k;
+public:
+	ResampleSwathBody(SwathStream &_s, int _k) : s(_s), k(_k) {}
+
+	void operator()(const Range &bands) const {
+		const ResampleContext &r = *s.r;
+		int n = r.sind.rows;
+		int width = r.sind.cols;
+		int lo = MAX(s.nsimg - RING_SORT, 0)*SWATH_SIZE;
+		int hi = s.nsimg*SWATH_SIZE;
+		Mat idx(SWATH_SIZE+1, width, CV_32SC1, s.scratch.ptr<int>(bands.start));
+
+		// sorting indices of the rows of swath k and the row after it
+		for(int i = k*SWATH_SIZE; i < MIN((k+1)*SWATH_SIZE+1, n); i++)
+			sortind_row(r.sind, i, idx.ptr<int>(i - k*SWATH_SIZE));
+		for(int b = bands.start; b < bands.end; b++) {
+			double t0 = s.times ? nowsec() : 0;
+			if(intband(s, b)) {
+				resampleswath16(s, b, k, idx);
+				if(s.times)
+					s.times[b].sec[ST_RESAMPLE] += nowsec() - t0;
+				continue;
+			}
+			for(int i = k*SWATH_SIZE; i < (k+1)*SWATH_SIZE; i++) {
+				float *dp = dstrow(s, b, i);
+				if(i == 0 || i == n-1) {
+					for(int x = 0; x < width; x++) {
+						float v = 0;
+						if(i == 0) {
+							// copy first non-nan value for first row
+							for(int j = lo; j < MIN(hi, n-1); j++) {
+								if(!isnan(simgrow(s, b, j)[x])) {
+									v = simgrow(s, b, j)[x];
+									break;
+								}
+							}
+						} else {
+							// copy last non-nan value to last row
+							for(int j = hi-1; j >= lo; j--) {
+								if(!isnan(simgrow(s, b, j)[x])) {
+									v = simgrow(s, b, j)[x];
+									break;
+								}
+							}
+						}
+						dp[x] = v;
+					}
+					continue;
+				}
+				s.nnan.at<int>(b, i) = resamplerow(idx.ptr<int>(i%SWATH_SIZE),
+					idx.ptr<int>(i%SWATH_SIZE+1),
+					r.lam.ptr<float>(i),
+					simgrow(s, b, i-1), simgrow(s, b, i), simgrow(s, b, i+1), dp, width);
+			}
+			if(s.times)
+				s.times[b].sec[ST_RESAMPLE] += nowsec() - t0;
+		}
+	}
+};
+
+// Set the bits of row y of the gap map gaps of the n pixels of r that
+// could not be resampled. The bands are unsorted by several threads,
+// so the bits are set atomically; such pixels are rare.
+static void
+setgaps(Mat &gaps, int y, const float *r, int n)
+{
+	unsigned char *p = gaps.ptr<unsigned char>(y);
+
+	for(int x = 0; x < n; x++) {
+		if(isnan(r[x]))
+			__sync_fetch_and_or(&p[x/8], 0x80 >> x%8);
+	}
+}
+
+// Unsorts swath k of band b of s, which is kept as integers, to the
+// rows of out.
+static void
+unsortswath16(SwathStream &s, int b, int k, unsigned short *out)
+{
+	const SortIndex &si = s.r->sind;
+	int width = si.cols;
+	int y0 = k*SWATH_SIZE;
+	const unsigned short *dst[3*SWATH_SIZE], **dp;
+
+	dp = swathrows(s, dst, dstrow16, b, k);
+	for(int y = y0; y < y0+SWATH_SIZE; y++) {
+		double t0 = s.times ? nowsec() : 0;
+		unsigned short *op = &out[(y-y0)*width];
+		if(s.sortoutput) {
+			memcpy(op, dp[y], width*sizeof(*op));
+		} else {
+			for(int j = si.uoff.at<int>(y, 0); j < si.uoff.at<int>(y+1, 0); j++) {
+				const int *sp = si.useg.ptr<int>(j);
+				memcpy(&op[sp[0]], &dp[sp[2]][sp[0]], (sp[1] - sp[0])*sizeof(*op));
+			}
+		}
+		s.changed.at<unsigned char>(b, y) = memcmp(op, inrow(s, b, y), width*sizeof(*op)) != 0;
+		if(s.times)
+			s.times[b].sec[ST_UNSORT] += nowsec() - t0;
+	}
+}
+
+// Unsorts swath k of each band and converts it back to integers.
+class UnsortSwathBody : public ParallelLoopBody {
+	SwathStream &s;
+	int k;
+	unsigned short *out;
+	size_t bandstride;
+public:
+	UnsortSwathBody(SwathStream &_s, int _k, unsigned short *_out, size_t _bandstride)
+		: s(_s), k(_k), out(_out), bandstride(_bandstride) {}
+
+	void operator()(const Range &bands) const {
+		const ResampleContext &r = *s.r;
+		int width = r.sind.cols;
+		int y0 = k*SWATH_SIZE;
+		float *rp = (float*)s.scratch.ptr<int>(bands.start);
+
+		for(int b = bands.start; b < bands.end; b++) {
+			if(intband(s, b)) {
+				unsortswath16(s, b, k, &out[b*bandstride]);
+				continue;
+			}
+			const float *dst[3*SWATH_SIZE], **dp;
+			dp = swathrows(s, dst, dstrow, b, k);
+			for(int y = y0; y < y0+SWATH_SIZE; y++) {
+				double t0 = s.times ? nowsec() : 0;
+				const float *rs = dstrow(s, b, y);
+				if(!s.sortoutput) {
+					const SortIndex &si = r.sind;
+					for(int j = si.uoff.at<int>(y, 0); j < si.uoff.at<int>(y+1, 0); j++) {
+						const int *sp = si.useg.ptr<int>(j);
+						memcpy(&rp[sp[0]], &dp[sp[2]][sp[0]], (sp[1] - sp[0])*sizeof(*rp));
+					}
+					rs = rp;
+				}
+				if(!s.gaps.empty())
+					setgaps(s.gaps, y, rs, width);
+				double t1 = s.times ? nowsec() : 0;
+				unsigned short *op = &out[b*bandstride + (y-y0)*width];
+				s.nclamped.at<int>(b, y) = convert_row_back(s.conv[b], rs, inrow(s, b, y), op, width);
+				s.changed.at<unsigned char>(b, y) = memcmp(op, inrow(s, b, y), width*sizeof(*op)) != 0;
+				if(s.times) {
+					s.times[b].sec[ST_UNSORT] += t1 - t0;
+					s.times[b].sec[ST_CONVBACK] += nowsec() - t1;
+				}
+			}
+		}
+	}
+};
+
+// Resamples the pixels of swath k of each band in the touch list of s
+// straight from the input swaths, and copies the other pixels. The
+// counts are kept by output row.
+class TouchSwathBody : public ParallelLoopBody {
+	SwathStream &s;
+	int k;
+	unsigned short *out;
+	size_t bandstride;
+public:
+	TouchSwathBody(SwathStream &_s, int _k, unsigned short *_out, size_t _bandstride)
+		: s(_s), k(_k), out(_out), bandstride(_bandstride) {}
+
+	void operator()(const Range &bands) const {
+		enum { CHUNK = 256 };
+		const TouchList &t = *s.touch;
+		int width = s.r->sind.cols;
+		int y0 = k*SWATH_SIZE;
+		unsigned short pv[CHUNK], sv[CHUNK], nv[CHUNK], ov[CHUNK];
+		float pf[CHUNK], sf[CHUNK], nf[CHUNK], rf[CHUNK];
+
+		for(int b = bands.start; b < bands.end; b++) {
+			const BandConv &c = s.conv[b];
+			for(int y = y0; y < y0+SWATH_SIZE; y++) {
+				double t0 = s.times ? nowsec() : 0;
+				const unsigned short *ip = inrow(s, b, y);
+				unsigned short *op = &out[b*bandstride + (y-y0)*width];
+				int nnan = 0, nclamped = 0;
+				bool changed = false;
+
+				memcpy(op, ip, width*sizeof(*op));
+				for(int j0 = t.off.at<int>(y, 0); j0 < t.off.at<int>(y+1, 0); j0 += CHUNK) {
+					int m = MIN(CHUNK, t.off.at<int>(y+1, 0) - j0);
+					const int *tp = t.pix.ptr<int>(j0);
+					for(int j = 0; j < m; j++, tp += 3) {
+						sv[j] = ip[tp[0]];
+						pv[j] = tp[1] >= 0 ? inrow(s, b, tp[1])[tp[0]] : 0;
+						nv[j] = tp[2] >= 0 ? inrow(s, b, tp[2])[tp[0]] : 0;
+					}
+					convert_row(c, pv, pf, m);
+					convert_row(c, sv, sf, m);
+					convert_row(c, nv, nf, m);
+					tp = t.pix.ptr<int>(j0);
+					for(int j = 0; j < m; j++, tp += 3) {
+						int x = tp[0];
+						if(tp[2] < 0) {
+							// first or last sorted row
+							rf[j] = tp[1] >= 0 ? pf[j] : 0;
+							continue;
+						}
+						if(ismasked(t.maskoverlap, tp[1], x)) pf[j] = NAN;
+						if(ismasked(t.maskoverlap, y, x)) sf[j] = NAN;
+						if(ismasked(t.maskoverlap, tp[2], x)) nf[j] = NAN;
+						rf[j] = resamplepix(tp[2] > y, t.lam.at<float>(j0+j, 0),
+							pf[j], sf[j], nf[j]);
+						if(isnan(rf[j])) {
+							nnan++;
+							if(!s.gaps.empty())
+								__sync_fetch_and_or(&s.gaps.ptr<unsigned char>(y)[x/8], 0x80 >> x%8);
+						}
+					}
+					nclamped += convert_row_back(c, rf, sv, ov, m);
+					tp = t.pix.ptr<int>(j0);
+					for(int j = 0; j < m; j++, tp += 3) {
+						op[tp[0]] = ov[j];
+						changed |= ov[j] != sv[j];
+					}
+				}
+				s.changed.at<unsigned char>(b, y) = changed;
+				s.nnan.at<int>(b, y) = nnan;
+				s.nclamped.at<int>(b, y) = nclamped;
+				if(t.maskoverlap) {
+					int noverlap = 0;
+					for(int x = 0; x < width; x++)
+						noverlap += isoverlap(y, x);
+					s.noverlap.at<int>(b, y) = noverlap;
+				}
+				if(s.times)
+					s.times[b].sec[ST_RESAMPLE] += nowsec() - t0;
+			}
+		}
+	}
+};
+
+// Computes the sorted and resampled swaths that the swaths pushed so
+// far allow, without overwriting swaths that are still needed.
+static void
+stream_advance(SwathStream &s)
+{
+	int last = s.nswath-1;
+
+	if(s.touch != NULL)
+		return;	// nothing is sorted
+
+	for(;;) {
+		if(s.ndst < s.nswath && s.nsimg > MIN(s.ndst+1, last) && s.nout > s.ndst - RING_SORT + 1) {
+			parallel_for_(Range(0, s.nband), ResampleSwathBody(s, s.ndst));
+			s.ndst++;
+			continue;
+		}
+		if(s.nsimg < s.nswath && s.nin > MIN(s.nsimg+1, last) && s.ndst > s.nsimg - RING_SORT + 1) {
+			parallel_for_(Range(0, s.nband), SortSwathBody(s, s.nsimg));
+			s.nsimg++;
+			continue;
+		}
+		break;
+	}
+}
+
+// Initialize stream s for resampling the nband bands converted with
+// conv using the resampling context r. The stream starts at input
+// swath first; the output starts at the same swath if first is 0, and
+// STREAM_LAG swaths later otherwise, because the swaths before first
+// are missing. This allows splitting a granule between several
+// streams. The rings are allocated from the arena a unless a is NULL.
+// To time the stages of each band, point s.times to an
+// array of nband zeroed BandTimes after this. To map the pixels that
+// could not be resampled, set s.gaps to a zeroed CV_8UC1 bitmap with
+// a row of (width+7)/8 bytes for each row of the granule. To resample
+// only the pixels that change, pass the touch list of r set up for the
+// same maskoverlap as touch, otherwise NULL; the output must then be
+// unsorted.
+// Returns -1 if the sorting indices of r move a row by more than a
+// swath, which the stream cannot follow, and 0 otherwise.
+//
+int
+stream_init(SwathStream &s, const ResampleContext &r, int nband, const BandConv *conv,
+	bool maskoverlap, bool sortoutput, const TouchList *touch, int first, Arena *a)
+{
+	int width = r.sind.cols;
+
+	if(r.sind.maxdisp > SWATH_SIZE)
+		return -1;
+	if(maskoverlap && width != WIDTH_1KM){
+		eprintf("width of image is %d, not %d", width, WIDTH_1KM);
+	}
+
+	s.r = &r;
+	s.conv = conv;
+	s.nband = nband;
+	s.maskoverlap = maskoverlap;
+	s.sortoutput = sortoutput;
+	s.nswath = r.sind.rows/SWATH_SIZE;
+	s.nin = first;
+	s.nsimg = first == 0 ? 0 : first+1;
+	s.ndst = first == 0 ? 0 : first+2;
+	s.nout = first == 0 ? 0 : first+STREAM_LAG;
+	s.touch = touch;
+	s.ringin = touch != NULL ? RING_TOUCH : RING_IN;
+	arena_mat(a, s.in, s.ringin*nband*SWATH_SIZE, width, CV_16UC1);
+	arena_mat(a, s.simg, RING_SORT*nband*SWATH_SIZE, width, CV_32FC1);
+	arena_mat(a, s.dst, RING_SORT*nband*SWATH_SIZE, width, CV_32FC1);
+
+	// each thread works on a range of bands, and uses the scratch
+	// rows of the first band of its range
+	arena_mat(a, s.scratch, nband, (SWATH_SIZE+1)*width, CV_32SC1);
+	arena_mat(a, s.nnan, nband, r.sind.rows, CV_32SC1);
+	arena_mat(a, s.nclamped, nband, r.sind.rows, CV_32SC1);
+	arena_mat(a, s.noverlap, nband, r.sind.rows, CV_32SC1);
+	arena_mat(a, s.changed, nband, r.sind.rows, CV_8UC1);
+	memset(s.nnan.data, 0, s.nnan.total()*sizeof(int));
+	memset(s.nclamped.data, 0, s.nclamped.total()*sizeof(int));
+	memset(s.noverlap.data, 0, s.noverlap.total()*sizeof(int));
+	memset(s.changed.data, 0, s.changed.total());
+	s.gaps.release();
+	s.times = NULL;
+	return 0;
+}
+
+// Push the next input swath into stream s. Row y of band b of the
+// swath is at in[b*bandstride + y*width]. The finished output swaths
+// must be pulled before pushing more than STREAM_LAG swaths ahead.
+//
+void
+stream_push(SwathStream &s, const unsigned short *in, size_t bandstride)
+{
+	int k = s.nin;
+	int width = s.r->sind.cols;
+
+	if(k >= s.nswath){
+		eprintf("pushed more than %d swaths", s.nswath);
+	}
+	stream_advance(s);
+	if(s.touch != NULL && k >= s.ringin && s.nout <= k-s.ringin+STREAM_LAG){
+		eprintf("swath %d pushed before swath %d was pulled", k, s.nout);
+	}
+	if(s.touch == NULL && k >= s.ringin && (s.nout <= k-s.ringin || s.nsimg <= k-s.ringin+1)){
+		eprintf("swath %d pushed before swath %d was pulled", k, s.nout);
+	}
+	for(int b = 0; b < s.nband; b++) {
+		memcpy(inrow(s, b, k*SWATH_SIZE), &in[b*bandstride], SWATH_SIZE*width*sizeof(*in));
+	}
+	s.nin++;
+}
+
+// Returns the index of the next finished output swath of stream s,
+// or -1 if it needs more input.
+//
+int
+stream_ready(SwathStream &s)
+{
+	stream_advance(s);
+	if(s.touch != NULL && s.nout < s.nswath && s.nin > MIN(s.nout+STREAM_LAG, s.nswath-1))
+		return s.nout;
+	if(s.touch == NULL && s.nout < s.nswath && s.ndst > MIN(s.nout+1, s.nswath-1))
+		return s.nout;
+	return -1;
+}
+
+// Pull the next finished output swath of stream s into out, with the
+// same layout as the input of stream_push.
+//
+// Returns the index of the swath, or -1 if it needs more input.
+//
+int
+stream_pull(SwathStream &s, unsigned short *out, size_t bandstride)
+{
+	int k = stream_ready(s);
+
+	if(k < 0)
+		return -1;
+	if(s.touch != NULL)
+		parallel_for_(Range(0, s.nband), TouchSwathBody(s, k, out, bandstride));
+	else
+		parallel_for_(Range(0, s.nband), UnsortSwathBody(s, k, out, bandstride));
+	s.nout++;
+	return k;
+}
+
+// Add the counts of the swaths [k0, k1) of stream s to stats[b] of
+// each band b. The pixels not resampled and the overlapping pixels are
+// counted by sorted row, and the clamped values by output row, so each
+// pixel is counted by the stream that outputs its swath.
+//
+void
+stream_stats(const SwathStream &s, int k0, int k1, BandStats *stats)
+{
+	for(int b = 0; b < s.nband; b++) {
+		for(int y = k0*SWATH_SIZE; y < k1*SWATH_SIZE; y++) {
+			stats[b].nnan += s.nnan.at<int>(b, y);
+			stats[b].nclamped += s.nclamped.at<int>(b, y);
+			stats[b].noverlap += s.noverlap.at<int>(b, y);
+		}
+	}
+}
+
+// Finish stream s after all its output swaths have been pulled.
+// The counts of the whole granule are then given by stream_stats.
+//
+void
+stream_finish(SwathStream &s)
+{
+	if(s.nout != s.nswath){
+		eprintf("stream finished at swath %d of %d", s.nout, s.nswath);
+	}
+}
+
+// Resamples ranges of swaths of several bands stored as scaled integers,
+// each with its own stream. A stream starts STREAM_LAG swaths before its
+// range to fill its rings, so the ranges are independent and each thread
+// gets its own range of ranges.
+class Resample16Body : public ParallelLoopBody {
+	const ResampleContext &r;
+	const unsigned short *in;
+	unsigned short *out;
+	int nband;
+	const BandConv *conv;
+	bool maskoverlap, sortoutput;
+	int nblock;
+	BandStats *stats;	// counts of each band of each range (output)
+public:
+	Resample16Body(const ResampleContext &_r, const unsigned short *_in, unsigned short *_out,
+		int _nband, const BandConv *_conv, bool _maskoverlap, bool _sortoutput,
+		int _nblock, BandStats *_stats)
+		: r(_r), in(_in), out(_out), nband(_nband), conv(_conv),
+		maskoverlap(_maskoverlap), sortoutput(_sortoutput), nblock(_nblock), stats(_stats) {}
+
+	void operator()(const Range &blocks) const {
+		int n = r.sind.rows;
+		int width = r.sind.cols;
+		int nswath = n/SWATH_SIZE;
+		size_t stride = (size_t)n*width;
+		Mat scratch(nband*SWATH_SIZE, width, CV_16UC1);
+
+		for(int blk = blocks.start; blk < blocks.end; blk++) {
+			int k0 = blk*nswath/nblock;
+			int k1 = (blk+1)*nswath/nblock;
+			int first = k0 < STREAM_LAG ? 0 : k0 - STREAM_LAG;
+			SwathStream s;
+
+			if(stream_init(s, r, nband, conv, maskoverlap, sortoutput, NULL, first, NULL) < 0){
+				eprintf("sorting moves rows by %d, more than a swath", r.sind.maxdisp);
+			}
+			for(int k = first; s.nout < k1; k++) {
+				if(k < nswath)
+					stream_push(s, &in[k*SWATH_SIZE*width], stride);
+				for(int j; s.nout < k1 && (j = stream_ready(s)) >= 0; ) {
+					// swaths before k0 belong to the previous range
+					if(j < k0)
+						stream_pull(s, scratch.ptr<unsigned short>(0), SWATH_SIZE*width);
+					else
+						stream_pull(s, &out[j*SWATH_SIZE*width], stride);
+				}
+			}
+			stream_stats(s, k0, k1, &stats[blk*nband]);
+		}
+	}
+};
+
+// Resample the nband bands of MODIS swath image in, stored as scaled
+// integers, into out using the resampling context r. This gives the
+// same result as converting the bands to physical values, resampling
+// them with resample_bands and converting them back, but streams
+// through the image a swath at a time and never holds the physical
+// values of more than a few swaths.
+// in[b*ny*nx + y*nx + x] - scaled integers of band b
+// out                    - resampled scaled integers, same layout as in (output)
+// conv[b]                - conversion of band b set up with convert_init
+// stats[b]               - counts of band b are added to it, unless stats is NULL
+//
+void
+resample_bands16(ResampleContext &r, const unsigned short *in, unsigned short *out, int nband,
+	const BandConv *conv, bool maskoverlap, bool sortoutput, BandStats *stats)
+{
+	int nswath = r.sind.rows/SWATH_SIZE;
+
+	CV_Assert(in != out);
+
+	// Each range repeats the STREAM_LAG swaths before it, so the
+	// ranges are kept long.
+	int nblock = MAX(MIN(getNumThreads(), nswath/(4*STREAM_LAG)), 1);
+	BandStats *bs = (BandStats*)calloc(nblock*nband, sizeof(*bs));
+	if(bs == NULL){
+		eprintf("out of memory");
+	}
+	parallel_for_(Range(0, nblock),
+		Resample16Body(r, in, out, nband, conv, maskoverlap, sortoutput, nblock, bs));
+	for(int blk = 0; stats != NULL && blk < nblock; blk++) {
+		for(int b = 0; b < nband; b++) {
+			stats[b].nnan += bs[blk*nband + b].nnan;
+			stats[b].nclamped += bs[blk*nband + b].nclamped;
+			stats[b].noverlap += bs[blk*nband + b].noverlap;
+		}
+	}
+	free(bs);
+}
+
+// Resample MODIS swath image _img using the resampling context r.
+// _img[0..ny][0..nx]  - original image (brightness temperature)
+//                       resampled in-place
+//
+// Returns the number of pixels that could not be resampled.
+//
+int
+resample_modis(ResampleContext &r, float **_img, bool maskoverlap, bool sortoutput)
+{
+	return resample_bands(r, _img, 1, maskoverlap, sortoutput);
+}
+
+// Resample VIIRS swatch image _img with corresponding
+// latitude image _lat.
+// _img[0..ny][0..nx]  - original image (brightness temperature)
+// _lat[0..ny][0..nx]  - original latitude
+// nx = width of image (should be 3200 for VIIRS)
+// ny = height of image ( 5408 or 5392 for ~10 min VIIRS granule)
+//
+// When resampling many bands of the same granule, use
+// resample_init once and the ResampleContext version instead.
+//
+// Returns the number of pixels that could not be resampled.
+//
+int
+resample_modis(float **_img, float *_lat, int nx, int ny,
+	bool maskoverlap, bool sortoutput)
+{
+	ResampleContext r;
+
+	resample_init(r, Mat(ny, nx, CV_32FC1, _lat), false);
+	return resample_modis(r, _img, maskoverlap, sortoutput);
 }
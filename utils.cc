@@ -2,6 +2,8 @@
 // Utility functions
 //
 
+#include <time.h>
+#include <sys/resource.h>
 #include "modisresam.h"
 
 void
@@ -62,6 +64,40 @@ emalloc(size_t n)
 	return buf;
 }
 
+// Returns the time in seconds of a clock that never jumps, for
+// measuring intervals.
+double
+nowsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// Returns the peak resident set size of the process in kilobytes.
+long
+peakrss(void)
+{
+	struct rusage ru;
+
+	if(getrusage(RUSAGE_SELF, &ru) != 0)
+		return -1;
+	return ru.ru_maxrss;
+}
+
+// Returns whether the CPU supports AVX2 instructions.
+bool
+haveavx2(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	static const bool have = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+	return have;
+#else
+	return false;
+#endif
+}
+
 const char*
 type2str(int type)
 {
@@ -106,10 +142,10 @@ dumpmat(const char *filename, Mat &m)
 	if(!f) {
 		eprintf("open %s failed:", filename);
 	}
-	n = fwrite(m.data, m.elemSize1(), m.rows*m.cols, f);
-	if(n != m.rows*m.cols) {
+	n = fwrite(m.data, m.elemSize1(), m.total()*m.channels(), f);
+	if(n != (int)(m.total()*m.channels())) {
 		fclose(f);
-		eprintf("wrote %d/%d items; write failed:", n, m.rows*m.cols);
+		eprintf("wrote %d/%d items; write failed:", n, (int)(m.total()*m.channels()));
 	}
 	fclose(f);
 }